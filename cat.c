@@ -1,66 +1,746 @@
 // vim: noet
 
+#define _GNU_SOURCE
+#include "lib/uring.h"
 #include "lib/utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 const char *usage[] = {
-	"[-u] [file...]",
+	"[-bnsuv] [file...]",
 	NULL,
 };
 
-const char *optstring = "u";
+const char *optstring = "bnsuv";
 
-int fcopy(FILE *out, FILE *in) {
-	int ch;
-	while ((ch = getc(in)) != EOF && putc(ch, out) != EOF);
-	return ferror(in) || ferror(out);
+enum {BUFFER_SIZE = 1<<17}; // 128KiB
+enum {SPLICE_SIZE = 1<<20}; // 1MiB
+
+bool unbuffered = false;
+char *iobuf;
+
+// Line processing options; any of these means we have to look at the data
+struct cat_options {
+	bool number, number_nonblank, squeeze_blank, show_nonprinting;
+} opt = {0};
+bool cooked = false;
+
+// Only non-blocking fds get here, when they return EAGAIN. Blocking fds just
+// block in read/write, which is as soon as we could possibly hear about data
+static int wait_fd(int fd, short events) {
+	struct pollfd pfd = {.fd = fd, .events = events};
+	for (;;) {
+		// Errors and hangups are left for the retried read/write to report
+		if (poll(&pfd, 1, -1) >= 0) return 0;
+		if (errno != EINTR) return -1;
+	}
 }
 
-int main(int argc, char *argv[]) {
-	int ch;
-	while ((ch = getopt(argc, argv, optstring)) >= 0) {
-		switch (ch) {
-		case 'u':
-			setvbuf(stdout, NULL, _IONBF, 0);
-			break;
+static ssize_t read_some(int fd, char *buf, size_t len) {
+	for (;;) {
+		ssize_t n = read(fd, buf, len);
+		if (n >= 0) return n;
+		if (errno == EINTR) continue;
+		if (errno == EAGAIN && !wait_fd(fd, POLLIN)) continue;
+		return -1;
+	}
+}
 
-		case '?':
-		default:
-			print_usage(*argv);
-			return 1;
+static int write_all(int fd, const char *buf, size_t len) {
+	while (len) {
+		ssize_t n = write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN && !wait_fd(fd, POLLOUT)) continue;
+			return -1;
 		}
+		buf += n;
+		len -= n;
 	}
+	return 0;
+}
 
-	// No arguments means copy stdin to stdout
-	if (optind >= argc) {
-		if (fcopy(stdout, stdin)) {
-			perror("fcopy: -");
-			return 1;
+// Works for any pair of fds; everything else falls back to this. It's also
+// what -u uses: whatever each read returns goes straight out in one write
+static int rw_copy(int out, int in) {
+	for (;;) {
+		ssize_t n = read_some(in, iobuf, BUFFER_SIZE);
+		if (n <= 0) return n;
+		if (write_all(out, iobuf, n)) return -1;
+	}
+}
+
+// Output buffer for cooked mode {{{
+
+char outbuf[BUFFER_SIZE];
+size_t outlen = 0;
+
+static int out_flush(void) {
+	size_t len = outlen;
+	outlen = 0;
+	return write_all(STDOUT_FILENO, outbuf, len);
+}
+
+static int out_write(const char *buf, size_t len) {
+	if (len > sizeof outbuf - outlen) {
+		if (out_flush()) return -1;
+		// Big runs skip the copy entirely
+		if (len >= sizeof outbuf) return write_all(STDOUT_FILENO, buf, len);
+	}
+	memcpy(outbuf + outlen, buf, len);
+	outlen += len;
+	return 0;
+}
+
+static int out_byte(char c) {
+	if (outlen == sizeof outbuf && out_flush()) return -1;
+	outbuf[outlen++] = c;
+	return 0;
+}
+
+// }}}
+
+// Cooked mode (-bnsv) {{{
+
+struct {
+	bool at_line_start, prev_blank;
+	unsigned long linen;
+} line = {true, false, 0};
+
+// Finds the next byte that isn't copied through verbatim: a newline, or with
+// -v anything other than tab and printable ASCII
+static const char *scan_special(const char *p, const char *end) {
+	if (!opt.show_nonprinting) {
+		const char *nl = memchr(p, '\n', end - p);
+		return nl ? nl : end;
+	}
+
+#ifdef __SSE2__
+	// Signed compares put bytes >= 0x80 below the printable range
+	const __m128i lo = _mm_set1_epi8(0x1f), hi = _mm_set1_epi8(0x7f), tab = _mm_set1_epi8('\t');
+	for (; end - p >= 16; p += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)p);
+		__m128i ok = _mm_and_si128(_mm_cmpgt_epi8(v, lo), _mm_cmplt_epi8(v, hi));
+		ok = _mm_or_si128(ok, _mm_cmpeq_epi8(v, tab));
+		unsigned mask = ~_mm_movemask_epi8(ok) & 0xffff;
+		if (mask) return p + __builtin_ctz(mask);
+	}
+#endif
+	for (; p < end; p++) {
+		unsigned char c = *p;
+		if ((c < 0x20 && c != '\t') || c >= 0x7f) break;
+	}
+	return p;
+}
+
+static int out_linenum(void) {
+	char buf[32], *p = buf + sizeof buf;
+	*--p = '\t';
+	unsigned long n = ++line.linen;
+	do *--p = '0' + n % 10; while (n /= 10);
+	while (buf + sizeof buf - p < 7) *--p = ' ';
+	return out_write(p, buf + sizeof buf - p);
+}
+
+// Shows c as ^X, M-X or M-^X, like other cats do
+static int out_nonprinting(unsigned char c) {
+	char buf[4], *p = buf;
+	if (c >= 0x80) {
+		*p++ = 'M';
+		*p++ = '-';
+		c -= 0x80;
+	}
+	if (c < 0x20) {
+		*p++ = '^';
+		*p++ = c + '@';
+	} else if (c == 0x7f) {
+		*p++ = '^';
+		*p++ = '?';
+	} else {
+		*p++ = c;
+	}
+	return out_write(buf, p - buf);
+}
+
+static int cook(const char *p, size_t len) {
+	const char *end = p + len;
+	while (p < end) {
+		if (line.at_line_start) {
+			if (*p == '\n') {
+				p++;
+				if (opt.squeeze_blank && line.prev_blank) continue;
+				line.prev_blank = true;
+				if (opt.number && !opt.number_nonblank && out_linenum()) return -1;
+				if (out_byte('\n')) return -1;
+				continue;
+			}
+
+			line.prev_blank = false;
+			line.at_line_start = false;
+			if (opt.number && out_linenum()) return -1;
 		}
-		return 0;
+
+		// Ordinary runs are copied in bulk
+		const char *q = scan_special(p, end);
+		if (out_write(p, q - p)) return -1;
+		if ((p = q) == end) break;
+
+		if (*p == '\n') {
+			line.at_line_start = true;
+			if (out_byte('\n')) return -1;
+		} else {
+			if (out_nonprinting(*p)) return -1;
+		}
+		p++;
+	}
+	return 0;
+}
+
+static int cooked_copy(int in) {
+	for (;;) {
+		ssize_t n = read_some(in, iobuf, BUFFER_SIZE);
+		if (n <= 0) return n;
+		if (cook(iobuf, n)) return -1;
+		if (unbuffered && out_flush()) return -1;
+	}
+}
+
+// }}}
+
+// Writes a chunk of an operand's data, cooking it if needed
+static int emit(const char *buf, size_t len) {
+	if (!cooked) return write_all(STDOUT_FILENO, buf, len);
+	if (cook(buf, len)) return -1;
+	return unbuffered ? out_flush() : 0;
+}
+
+#ifdef __linux__
+// Errors meaning the kernel can't do this kind of copy between these fds
+static bool unsupported(int err) {
+	switch (err) {
+	case EINVAL:
+	case ENOSYS:
+	case EXDEV:
+	case EOPNOTSUPP:
+	case EBADF: // copy_file_range on an O_APPEND output
+	case EAGAIN: // Non-blocking fds are left to the read/write loop
+		return true;
+	default:
+		return false;
 	}
+}
+
+static ssize_t do_copy_file_range(int out, int in, size_t len) {
+	return copy_file_range(in, NULL, out, NULL, len, 0);
+}
 
-	for (int i = optind; i < argc; i++) {
-		if (!strcmp(argv[i], "-")) {
-			if (fcopy(stdout, stdin)) {
-				perrorf("fcopy: %s", argv[i]);
+static ssize_t do_sendfile(int out, int in, size_t len) {
+	return sendfile(out, in, NULL, len);
+}
+
+static ssize_t do_splice(int out, int in, size_t len) {
+	return splice(in, NULL, out, NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+}
+
+// Returns 1 if the input was copied to EOF, 0 if the method is unsupported
+// (nothing is lost, since all of these advance the file offsets) and -1 on error
+static int kernel_copy(ssize_t (*copy)(int, int, size_t), int out, int in) {
+	for (;;) {
+		ssize_t n = copy(out, in, SPLICE_SIZE);
+		if (n == 0) return 1;
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return unsupported(errno) ? 0 : -1;
+		}
+	}
+}
+
+static int pwrite_all(int fd, const char *buf, size_t len, off_t off) {
+	while (len) {
+		ssize_t n = pwrite(fd, buf, len, off);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
+
+// Copies len bytes between explicit offsets, leaving the file offsets alone.
+// Returns the number of bytes copied, which is short if the input shrank
+static off_t copy_range(int out, int in, off_t ipos, off_t opos, off_t len) {
+	static bool cfr_works = true;
+	off_t done = 0;
+	while (done < len) {
+		size_t want = len - done < SPLICE_SIZE ? len - done : SPLICE_SIZE;
+		ssize_t n;
+		if (cfr_works) {
+			loff_t ioff = ipos + done, ooff = opos + done;
+			n = copy_file_range(in, &ioff, out, &ooff, want, 0);
+			if (n < 0 && unsupported(errno)) {
+				cfr_works = false;
+				continue;
+			}
+		} else {
+			if (want > BUFFER_SIZE) want = BUFFER_SIZE;
+			n = pread(in, iobuf, want, ipos + done);
+			if (n > 0 && pwrite_all(out, iobuf, n, opos + done)) return -1;
+		}
+
+		if (n == 0) break;
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		done += n;
+	}
+	return done;
+}
+
+// Copies only the data extents of a sparse input and seeks over the holes,
+// so the output stays sparse. The output has to be positioned at its end,
+// otherwise what we skip wouldn't read back as zeros.
+// Whatever it doesn't copy (e.g. if the input grew) is left to the caller.
+static int sparse_copy(int out, int in, const struct stat *ist, const struct stat *ost) {
+	// Dense files don't need the extra lseeks
+	if ((off_t)ist->st_blocks * 512 >= ist->st_size) return 0;
+
+	int flags = fcntl(out, F_GETFL);
+	if (flags < 0 || (flags & O_APPEND)) return 0;
+	off_t ipos = lseek(in, 0, SEEK_CUR), opos = lseek(out, 0, SEEK_CUR);
+	if (ipos < 0 || opos < 0 || opos < ost->st_size) return 0;
+
+	off_t end = ist->st_size;
+	while (ipos < end) {
+		off_t data = lseek(in, ipos, SEEK_DATA);
+		if (data < 0) {
+			// ENXIO means there's only a hole left
+			if (errno != ENXIO) return unsupported(errno) ? 0 : -1;
+			data = end;
+		}
+		if (data > end) data = end;
+
+		off_t hole = data < end ? lseek(in, data, SEEK_HOLE) : end;
+		if (hole < 0) return -1;
+		if (hole > end) hole = end;
+
+		opos += data - ipos;
+		off_t n = copy_range(out, in, data, opos, hole - data);
+		if (n < 0) return -1;
+		opos += n;
+		ipos = data + n;
+		if (n < hole - data) break; // Input was truncated under us
+	}
+
+	// A trailing hole doesn't make it into the output on its own
+	struct stat st;
+	if (fstat(out, &st)) return -1;
+	if (st.st_size < opos && ftruncate(out, opos)) return -1;
+
+	if (lseek(in, ipos, SEEK_SET) < 0 || lseek(out, opos, SEEK_SET) < 0) return -1;
+	return 0;
+}
+
+// splice needs a pipe on one end, so when neither fd is one we bring our own
+static int splice_via_pipe(int out, int in) {
+	int p[2];
+	if (pipe(p)) return 0;
+
+	int ret;
+	for (;;) {
+		ssize_t n = splice(in, NULL, p[1], NULL, SPLICE_SIZE, SPLICE_F_MOVE);
+		if (n == 0) {
+			ret = 1;
+			break;
+		}
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			ret = unsupported(errno) ? 0 : -1;
+			break;
+		}
+
+		while (n) {
+			ssize_t m = splice(p[0], NULL, out, NULL, n, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (m < 0 && errno == EINTR) continue;
+			if (m < 0 && unsupported(errno)) {
+				// The output can't take spliced data; drain what we already
+				// pulled from the input and let the caller take over
+				while (n) {
+					m = read(p[0], iobuf, n < BUFFER_SIZE ? n : BUFFER_SIZE);
+					if (m < 0 && errno == EINTR) continue;
+					if (m <= 0 || write_all(out, iobuf, m)) {
+						ret = -1;
+						goto done;
+					}
+					n -= m;
+				}
+				ret = 0;
+				goto done;
+			}
+			if (m <= 0) {
+				ret = -1;
+				goto done;
+			}
+			n -= m;
+		}
+	}
+
+done:;
+	int err = errno;
+	close(p[0]);
+	close(p[1]);
+	errno = err;
+	return ret;
+}
+
+// Try to move the data without it passing through userspace
+static int offload_copy(int out, int in) {
+	struct stat ist, ost;
+	if (fstat(in, &ist) || fstat(out, &ost)) return -1;
+
+	// Files in /proc and friends claim to be empty, and the kernel copy
+	// functions take them at their word
+	bool in_file = S_ISREG(ist.st_mode) && ist.st_size > 0;
+	bool in_pipe = S_ISFIFO(ist.st_mode), out_pipe = S_ISFIFO(ost.st_mode);
+
+	int ret = 0;
+	if (in_file && S_ISREG(ost.st_mode)) {
+		if (sparse_copy(out, in, &ist, &ost)) return -1;
+		ret = kernel_copy(do_copy_file_range, out, in);
+	}
+	if (!ret && (in_pipe || (in_file && out_pipe))) ret = kernel_copy(do_splice, out, in);
+	if (!ret && in_file) ret = kernel_copy(do_sendfile, out, in);
+	if (!ret && !in_pipe && !out_pipe && !S_ISREG(ist.st_mode)) ret = splice_via_pipe(out, in);
+	return ret;
+}
+#endif
+
+int fcopy(int out, int in) {
+	if (cooked) return cooked_copy(in) < 0;
+#ifdef __linux__
+	if (!unbuffered) {
+		int ret = offload_copy(out, in);
+		if (ret) return ret < 0;
+	}
+#endif
+	return rw_copy(out, in) < 0;
+}
+
+static int cat_files(char **files, int n) {
+	for (int i = 0; i < n; i++) {
+		if (!strcmp(files[i], "-")) {
+			if (fcopy(STDOUT_FILENO, STDIN_FILENO)) {
+				perrorf("fcopy: %s", files[i]);
 				return 1;
 			}
 		} else {
-			FILE *f = fopen(argv[i], "r");
-			if (!f) {
-				perrorf("fopen: %s", argv[i]);
+			int fd = open(files[i], O_RDONLY);
+			if (fd < 0) {
+				perrorf("fopen: %s", files[i]);
 				return 1;
 			}
 
-			if (fcopy(stdout, f)) {
-				perrorf("fcopy: %s", argv[i]);
+			if (fcopy(STDOUT_FILENO, fd)) {
+				perrorf("fcopy: %s", files[i]);
 				return 1;
 			}
+			close(fd);
+		}
+	}
+	return 0;
+}
+
+#ifdef __linux__
+// Batched mode for lots of (mostly small) files: opens and reads run ahead of
+// the writer through io_uring, which still writes in operand order
+enum {URING_ENTRIES = 256};
+enum {URING_SLOTS = 64}; // At most; fewer if the fd limit is low
+enum {URING_BUFFER_SIZE = 1<<16}; // 64KiB per slot
+enum {CLOSE_TAG = URING_SLOTS}; // user_data for closes, whose results we ignore
+
+struct uring_slot {
+	const char *name;
+	enum {SLOT_OPENING, SLOT_READING, SLOT_DONE} state;
+	int fd, err;
+	bool is_stdin, eof;
+	size_t len;
+	char *buf;
+};
+
+struct uring ring;
+unsigned inflight = 0;
+
+static bool uring_setup(void) {
+	if (uring_init(&ring, URING_ENTRIES)) return false;
+	if (uring_supports(&ring, IORING_OP_OPENAT) &&
+			uring_supports(&ring, IORING_OP_READ) &&
+			uring_supports(&ring, IORING_OP_CLOSE)) return true;
+	uring_free(&ring);
+	return false;
+}
+
+static struct io_uring_sqe *get_sqe(void) {
+	// Completions are only reaped by the writer, so don't let them pile up
+	if (inflight >= ring.cq_entries / 2) return NULL;
+	struct io_uring_sqe *sqe = uring_sqe(&ring);
+	if (!sqe && uring_submit(&ring, 0) >= 0) sqe = uring_sqe(&ring);
+	if (sqe) inflight++;
+	return sqe;
+}
+
+static bool uring_read(struct uring_slot *slot, unsigned tag) {
+	struct io_uring_sqe *sqe = get_sqe();
+	if (!sqe) return false;
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = slot->fd;
+	sqe->addr = (uintptr_t)(slot->buf + slot->len);
+	sqe->len = URING_BUFFER_SIZE - slot->len;
+	sqe->off = -1; // Use (and advance) the file offset
+	sqe->user_data = tag;
+	return true;
+}
+
+static bool uring_start(struct uring_slot *slot, const char *name, unsigned tag) {
+	slot->name = name;
+	slot->fd = -1;
+	slot->err = 0;
+	slot->is_stdin = slot->eof = false;
+	slot->len = 0;
+
+	if (!strcmp(name, "-")) {
+		// Read synchronously once the writer gets to it
+		slot->fd = STDIN_FILENO;
+		slot->is_stdin = true;
+		slot->state = SLOT_DONE;
+		return true;
+	}
+
+	struct io_uring_sqe *sqe = get_sqe();
+	if (!sqe) return false;
+	sqe->opcode = IORING_OP_OPENAT;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (uintptr_t)name;
+	sqe->open_flags = O_RDONLY;
+	sqe->user_data = tag;
+	slot->state = SLOT_OPENING;
+	return true;
+}
+
+static void uring_close(int fd) {
+	struct io_uring_sqe *sqe = get_sqe();
+	if (!sqe) {
+		close(fd);
+		return;
+	}
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->fd = fd;
+	sqe->user_data = CLOSE_TAG;
+}
+
+static void uring_complete(struct uring_slot *slots, struct io_uring_cqe *cqe) {
+	unsigned tag = cqe->user_data;
+	int res = cqe->res;
+	uring_seen(&ring);
+	inflight--;
+	if (tag == CLOSE_TAG) return;
+
+	struct uring_slot *slot = &slots[tag];
+	if (slot->state == SLOT_OPENING && (res == -EMFILE || res == -ENFILE)) {
+		// Our own read-ahead took the fds, so the writer opens it itself
+		// once the others are closed
+		slot->state = SLOT_DONE;
+		return;
+	}
+	if (res < 0) {
+		slot->err = -res;
+		slot->state = SLOT_DONE;
+		return;
+	}
+
+	if (slot->state == SLOT_OPENING) {
+		slot->fd = res;
+		slot->state = SLOT_READING;
+		// Big or sparse files go through fcopy as a whole, so the kernel
+		// does the copying and holes stay holes
+		struct stat st;
+		if (!fstat(res, &st) && S_ISREG(st.st_mode) &&
+				(st.st_size > URING_BUFFER_SIZE || st.st_blocks * 512 < st.st_size)) {
+			slot->state = SLOT_DONE;
+			return;
+		}
+	} else {
+		slot->eof = res == 0;
+		slot->len += res;
+		if (slot->eof || slot->len == URING_BUFFER_SIZE) {
+			slot->state = SLOT_DONE;
+			return;
+		}
+	}
+
+	// Keep reading until EOF or the buffer is full; if we can't, the writer
+	// picks up the rest synchronously
+	if (!uring_read(slot, tag)) slot->state = SLOT_DONE;
+}
+
+// Opens operand i, which the read-ahead had no fd for. If there's still none,
+// wait on what's in the ring (closes, mostly), then take fds back from the
+// furthest read-ahead, which is opened again when the writer gets there
+static int uring_open_late(struct uring_slot *slots, int i, int next, int nslots) {
+	int fd;
+	while ((fd = open(slots[i % nslots].name, O_RDONLY)) < 0 && (errno == EMFILE || errno == ENFILE)) {
+		if (inflight) {
+			struct io_uring_cqe *cqe = uring_wait(&ring);
+			if (!cqe) break;
+			uring_complete(slots, cqe);
+			continue;
+		}
+
+		while (--next > i && (slots[next % nslots].fd < 0 || slots[next % nslots].is_stdin));
+		if (next == i) break;
+		struct uring_slot *ahead = &slots[next % nslots];
+		close(ahead->fd);
+		ahead->fd = -1;
+		ahead->len = 0;
+		ahead->eof = false;
+		ahead->state = SLOT_DONE;
+	}
+	return fd;
+}
+
+static int uring_cat(char **files, int n) {
+	struct uring_slot slots[URING_SLOTS];
+	char *bufs = malloc((size_t)URING_SLOTS * URING_BUFFER_SIZE);
+	if (!bufs) return perror("malloc"), 1;
+	for (int i = 0; i < URING_SLOTS; i++) slots[i].buf = bufs + (size_t)i * URING_BUFFER_SIZE;
+
+	// Open operands and closes in the ring both hold fds, so leave the
+	// writer and everything else at least half
+	int nslots = URING_SLOTS;
+	struct rlimit rl;
+	if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur != RLIM_INFINITY && (long)rl.rlim_cur / 4 < nslots) {
+		nslots = rl.rlim_cur / 4;
+		if (nslots < 1) nslots = 1;
+	}
+
+	int next = 0;
+	for (int i = 0; i < n; i++) {
+		for (; next < n && next - i < nslots; next++) {
+			if (!uring_start(&slots[next % nslots], files[next], next % nslots)) break;
+		}
+		// The writer has caught up, so make room for at least its own operand
+		while (next == i) {
+			if (uring_start(&slots[i % nslots], files[i], i % nslots)) {
+				next++;
+				break;
+			}
+			struct io_uring_cqe *cqe = uring_wait(&ring);
+			if (!cqe) return perror("io_uring_enter"), 1;
+			uring_complete(slots, cqe);
+		}
+
+		struct uring_slot *slot = &slots[i % nslots];
+		while (slot->state != SLOT_DONE) {
+			struct io_uring_cqe *cqe = uring_wait(&ring);
+			if (!cqe) return perror("io_uring_enter"), 1;
+			uring_complete(slots, cqe);
 		}
+
+		if (slot->err) {
+			errno = slot->err;
+			perrorf("%s: %s", slot->fd < 0 ? "fopen" : "fcopy", slot->name);
+			return 1;
+		}
+		if (slot->fd < 0 && (slot->fd = uring_open_late(slots, i, next, nslots)) < 0) {
+			perrorf("fopen: %s", slot->name);
+			return 1;
+		}
+		if (emit(slot->buf, slot->len) || (!slot->eof && fcopy(STDOUT_FILENO, slot->fd))) {
+			perrorf("fcopy: %s", slot->name);
+			return 1;
+		}
+		if (!slot->is_stdin) uring_close(slot->fd);
 	}
 
+	free(bufs);
 	return 0;
 }
+#endif
+
+int main(int argc, char *argv[]) {
+	int ch;
+	while ((ch = getopt(argc, argv, optstring)) >= 0) {
+		switch (ch) {
+		case 'b':
+			opt.number = opt.number_nonblank = cooked = true;
+			break;
+
+		case 'n':
+			opt.number = cooked = true;
+			break;
+
+		case 's':
+			opt.squeeze_blank = cooked = true;
+			break;
+
+		case 'v':
+			opt.show_nonprinting = cooked = true;
+			break;
+
+		case 'u':
+			// All output is unbuffered; this just keeps the data in userspace
+			// so it is forwarded as soon as each read returns
+			unbuffered = true;
+			break;
+
+		case '?':
+		default:
+			print_usage(*argv);
+			return 1;
+		}
+	}
+
+	long pagesz = sysconf(_SC_PAGESIZE);
+	if ((errno = posix_memalign((void **)&iobuf, pagesz > 0 ? pagesz : 4096, BUFFER_SIZE))) {
+		perror("posix_memalign");
+		return 1;
+	}
+
+	// No arguments means copy stdin to stdout
+	char *stdin_only[] = {"-"};
+	char **files = argv + optind;
+	int nfiles = argc - optind;
+	if (!nfiles) {
+		files = stdin_only;
+		nfiles = 1;
+	}
+
+	int ret = -1;
+#ifdef __linux__
+	if (!unbuffered && nfiles > 1 && uring_setup()) ret = uring_cat(files, nfiles);
+#endif
+	if (ret < 0) ret = cat_files(files, nfiles);
+
+	if (out_flush()) {
+		perror("write");
+		return 1;
+	}
+	return ret;
+}
@@ -1,78 +1,815 @@
 // vim: noet
 
+#define _GNU_SOURCE
 #include "lib/utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __linux__
+#include <sys/xattr.h>
+#endif
 
 const char *usage[] = {
-	"[-l|-s] file1 file2",
+	"[-l|-s] [-x|-X] [-j jobs] [-n limit] file1 file2 [skip1 [skip2]]",
+	"-m [-s] [-n limit] reference file...",
 	NULL,
 };
 
-const char *optstring = "ls";
+const char *optstring = "lsxXj:n:m";
 struct cmp_options {
 	bool list, silent;
+	bool cache, cache_write;
+	bool many;
+	long jobs;
+	uintmax_t limit;
 } opt = {0};
 
 #define error(...) return (opt.silent ? 0 : (perrorf(__VA_ARGS__), 0)), 2
 //#define error(...) return opt.silent || (perrorf(__VA_ARGS__), 0), 2
 
-static int do_cmp(const char *file1, const char *file2) {
-	FILE *f1;
-	if (!strcmp(file1, "-")) {
-		f1 = stdin;
-	} else {
-		f1 = fopen(file1, "rb");
-		if (!f1) error("fopen: %s", file1);
+enum {BUFFER_SIZE = 1<<18}; // 256KiB
+enum {WINDOW_SIZE = 1<<26}; // 64MiB of each file mapped at a time
+enum {CHUNK_SIZE = 1<<22}; // 4MiB of each file per -l job
+enum {CHUNKS_AHEAD = 4}; // Per thread, to bound buffered output
+
+struct input {
+	const char *name;
+	int fd;
+	struct stat st;
+	off_t off; // Where the comparison starts
+	unsigned char *buf;
+	size_t pos, len;
+	bool eof;
+};
+
+// Progress through the inputs, shared by everything that compares blocks
+struct cmp_state {
+	size_t byten, linen;
+	bool identical;
+};
+
+// Block kernels {{{
+
+// Finds the first byte where a and b differ, or n if they don't
+static size_t mismatch(const unsigned char *a, const unsigned char *b, size_t n) {
+	// memcmp is about as fast as it gets for the common all-equal case
+	if (!memcmp(a, b, n)) return n;
+
+	size_t i = 0;
+#ifdef __SSE2__
+	for (; n - i >= 16; i += 16) {
+		__m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+		unsigned mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) & 0xffff;
+		if (mask) return i + __builtin_ctz(mask);
 	}
+#endif
+	while (i < n && a[i] == b[i]) i++;
+	return i;
+}
+
+// Finds the first nonzero byte, or n if there isn't one
+static size_t nonzero(const unsigned char *p, size_t n) {
+	size_t i = 0;
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128();
+	// Or together a cache line at a time; zeros are all we expect to see
+	for (; n - i >= 64; i += 64) {
+		__m128i v = _mm_or_si128(
+			_mm_or_si128(_mm_loadu_si128((const __m128i *)(p + i)), _mm_loadu_si128((const __m128i *)(p + i + 16))),
+			_mm_or_si128(_mm_loadu_si128((const __m128i *)(p + i + 32)), _mm_loadu_si128((const __m128i *)(p + i + 48))));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xffff) break;
+	}
+	for (; n - i >= 16; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+		unsigned mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) & 0xffff;
+		if (mask) return i + __builtin_ctz(mask);
+	}
+#endif
+	while (i < n && !p[i]) i++;
+	return i;
+}
 
-	FILE *f2;
-	if (!strcmp(file1, "-")) {
-		f2 = stdin;
-	} else {
-		f2 = fopen(file2, "rb");
-		if (!f2) error("fopen: %s", file2);
+static size_t count_newlines(const unsigned char *p, size_t n) {
+	size_t count = 0, i = 0;
+#ifdef __SSE2__
+	// Each matching byte is -1, so subtracting tallies per-lane counts,
+	// which are summed with psadbw before they can overflow
+	const __m128i nl = _mm_set1_epi8('\n'), zero = _mm_setzero_si128();
+	while (n - i >= 16) {
+		__m128i acc = zero;
+		for (int k = 0; k < 255 && n - i >= 16; k++, i += 16) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+			acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(v, nl));
+		}
+		__m128i sum = _mm_sad_epu8(acc, zero);
+		count += _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
 	}
+#endif
+	for (; i < n; i++) count += p[i] == '\n';
+	return count;
+}
 
-	size_t byten = 0, linen = 1;
-	bool identical = true;
-	int c1 = 0, c2 = 0;
+// }}}
 
-#define get1char(n) if ((c##n = fgetc(f##n)) == EOF && ferror(f##n)) error("fgetc: %s", file##n)
+// Compares n bytes that both inputs have. Returns true if we're done, which
+// is at the first difference unless we're listing them all.
+// Either side may be NULL for a hole, which reads as zeros
+static bool cmp_block(struct cmp_state *st, const unsigned char *a, const unsigned char *b, size_t n, const char *file1, const char *file2) {
+	for (size_t off = 0; off < n;) {
+		size_t i = off + (!a ? nonzero(b + off, n - off) : !b ? nonzero(a + off, n - off) : mismatch(a + off, b + off, n - off));
+		// Lines only matter for the first difference, and zeros have none
+		if (!opt.list && a && b) st->linen += count_newlines(a + off, i - off);
+		if (i == n) break;
 
-	while (c1 != EOF && c2 != EOF) {
-		get1char(1);
-		get1char(2);
-		byten++;
+		if (opt.list) {
+			printf("%zu %o %o\n", st->byten + i + 1, a ? a[i] : 0, b ? b[i] : 0);
+			st->identical = false;
+		} else {
+			if (!opt.silent) printf("%s %s differ: char %zu, line %zu\n", file1, file2, st->byten + i + 1, st->linen);
+			return true;
+		}
+		off = i + 1;
+	}
+	st->byten += n;
+	return false;
+}
 
-		if (c1 != c2) {
-			if (c1 == EOF || c2 == EOF) {
-				if (opt.list || !opt.silent) {
-					eprintf("cmp: EOF on %s after byte %zu\n", c1 == EOF ? file1 : file2, byten);
-				}
-				return 1;
-			} else {
-				if (opt.list) {
-					printf("%zu %o %o\n", byten, c1, c2);
-					identical = 0;
-				} else {
-					if (!opt.silent) printf("%s %s differ: char %zu, line %zu\n", file1, file2, byten, linen);
-					return 1;
-				}
+// Reads through n bytes of an input that can't seek
+static int discard(struct input *in, uintmax_t n) {
+	while (n) {
+		ssize_t len = read(in->fd, in->buf, n < BUFFER_SIZE ? n : BUFFER_SIZE);
+		if (len < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		if (!len) break;
+		n -= len;
+	}
+	return 0;
+}
+
+static int open_input(struct input *in, const char *name, uintmax_t skip) {
+	in->name = name;
+	in->pos = in->len = 0;
+	in->eof = false;
+	if (!(in->buf = malloc(BUFFER_SIZE))) return -1;
+	if (!strcmp(name, "-")) {
+		in->fd = STDIN_FILENO;
+	} else if ((in->fd = open(name, O_RDONLY)) < 0) {
+		return -1;
+	}
+
+	if (fstat(in->fd, &in->st)) return -1;
+	// stdin may not be at the start, so skip from wherever it is
+	if (lseek(in->fd, 0, SEEK_CUR) < 0) {
+		in->off = 0;
+		if (discard(in, skip)) return -1;
+	} else if ((in->off = lseek(in->fd, (off_t)skip, SEEK_CUR)) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+// Whether we can trust st_size; files in /proc and friends claim to be empty
+static bool sized(const struct input *in) {
+	return S_ISREG(in->st.st_mode) && in->st.st_size > 0;
+}
+
+// How much of a sized input is to be compared
+static off_t remaining(const struct input *in) {
+	off_t n = in->off < in->st.st_size ? in->st.st_size - in->off : 0;
+	return (uintmax_t)n > opt.limit ? (off_t)opt.limit : n;
+}
+
+static void close_input(struct input *in) {
+	if (in->fd != STDIN_FILENO) close(in->fd);
+	free(in->buf);
+}
+
+// Reads more once everything buffered has been compared
+static int refill(struct input *in) {
+	if (in->pos < in->len || in->eof) return 0;
+	in->pos = 0;
+	for (;;) {
+		ssize_t n = read(in->fd, in->buf, BUFFER_SIZE);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			in->len = 0;
+			return -1;
+		}
+		in->len = n;
+		in->eof = n == 0;
+		return 0;
+	}
+}
+
+static int cmp_streams(struct input *f1, struct input *f2) {
+	struct cmp_state st = {0, 1, true};
+	for (uintmax_t left = opt.limit; left;) {
+		if (refill(f1)) error("read: %s", f1->name);
+		if (refill(f2)) error("read: %s", f2->name);
+
+		size_t n1 = f1->len - f1->pos, n2 = f2->len - f2->pos;
+		if (!n1 || !n2) {
+			if (n1 == n2) break;
+			if (opt.list || !opt.silent) {
+				eprintf("cmp: EOF on %s after byte %zu\n", n1 ? f2->name : f1->name, st.byten + 1);
+			}
+			return 1;
+		}
+
+		size_t n = n1 < n2 ? n1 : n2;
+		if (n > left) n = left;
+		if (cmp_block(&st, f1->buf + f1->pos, f2->buf + f2->pos, n, f1->name, f2->name)) return 1;
+		f1->pos += n;
+		f2->pos += n;
+		left -= n;
+	}
+	return !st.identical;
+}
+
+// Maps len bytes of in from off, returning a pointer to them
+static const unsigned char *map_window(const struct input *in, off_t off, size_t len, void **base, size_t *maplen) {
+	long pagesz = sysconf(_SC_PAGESIZE);
+	if (pagesz <= 0) pagesz = 4096;
+
+	off_t aligned = off - off % pagesz;
+	*maplen = len + (off - aligned);
+	*base = mmap(NULL, *maplen, PROT_READ, MAP_PRIVATE, in->fd, aligned);
+	if (*base == MAP_FAILED) return NULL;
+	posix_madvise(*base, *maplen, POSIX_MADV_SEQUENTIAL);
+	return (unsigned char *)*base + (off - aligned);
+}
+
+// Whether off is in a hole, and where that hole or run of data ends
+static bool extent(const struct input *in, off_t off, off_t *end) {
+	*end = in->st.st_size;
+#ifdef SEEK_DATA
+	off_t data = lseek(in->fd, off, SEEK_DATA);
+	if (data < 0) return errno == ENXIO; // Either a hole to the end, or no idea
+	if (data > off) return *end = data, true;
+	off_t hole = lseek(in->fd, off, SEEK_HOLE);
+	if (hole > off) *end = hole;
+#endif
+	return false;
+}
+
+// Files with fewer blocks than bytes have holes, or at least might
+static bool sparse(const struct input *in) {
+	return (uintmax_t)in->st.st_blocks * 512 < (uintmax_t)in->st.st_size;
+}
+
+// Parallel -l {{{
+
+// Each chunk's records are buffered by whichever worker compares it, and
+// written out in order by the main thread
+struct chunk {
+	char *out;
+	size_t len, cap;
+	int err;
+	bool done;
+};
+
+struct list_job {
+	const struct input *f1, *f2;
+	off_t common;
+	size_t nchunks, next, written;
+	struct chunk *chunks;
+	bool stop;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static int chunk_append(struct chunk *c, size_t byten, unsigned a, unsigned b) {
+	// "%zu %o %o\n" is at most this long
+	enum {RECORD_MAX = 20 + 1 + 3 + 1 + 3 + 2};
+	if (c->cap - c->len < RECORD_MAX) {
+		size_t cap = c->cap ? c->cap * 2 : 4096;
+		char *out = realloc(c->out, cap);
+		if (!out) return -1;
+		c->out = out;
+		c->cap = cap;
+	}
+	c->len += snprintf(c->out + c->len, c->cap - c->len, "%zu %o %o\n", byten, a, b);
+	return 0;
+}
+
+static int list_chunk(struct list_job *job, size_t k) {
+	struct chunk *c = &job->chunks[k];
+	off_t off = (off_t)k * CHUNK_SIZE;
+	size_t n = job->common - off < CHUNK_SIZE ? job->common - off : CHUNK_SIZE;
+
+	void *base1, *base2;
+	size_t maplen1, maplen2;
+	const unsigned char *a = map_window(job->f1, job->f1->off + off, n, &base1, &maplen1);
+	if (!a) return -1;
+	const unsigned char *b = map_window(job->f2, job->f2->off + off, n, &base2, &maplen2);
+	if (!b) {
+		munmap(base1, maplen1);
+		return -1;
+	}
+
+	int ret = 0;
+	for (size_t i = 0; (i += mismatch(a + i, b + i, n - i)) < n; i++) {
+		if ((ret = chunk_append(c, off + i + 1, a[i], b[i]))) break;
+	}
+	munmap(base1, maplen1);
+	munmap(base2, maplen2);
+	return ret;
+}
+
+static void *list_worker(void *arg) {
+	struct list_job *job = arg;
+	pthread_mutex_lock(&job->lock);
+	for (;;) {
+		size_t ahead = CHUNKS_AHEAD * opt.jobs;
+		while (!job->stop && job->next < job->nchunks && job->next - job->written >= ahead) {
+			pthread_cond_wait(&job->cond, &job->lock);
+		}
+		if (job->stop || job->next >= job->nchunks) break;
+		size_t k = job->next++;
+		pthread_mutex_unlock(&job->lock);
+
+		int err = list_chunk(job, k) ? errno : 0;
+
+		pthread_mutex_lock(&job->lock);
+		job->chunks[k].err = err;
+		job->chunks[k].done = true;
+		pthread_cond_broadcast(&job->cond);
+	}
+	pthread_mutex_unlock(&job->lock);
+	return NULL;
+}
+
+// Same output as cmp_block would give for the common part of two mapped files.
+// Returns 1 if there were differences and -1 on error, with errno set
+static int list_parallel(const struct input *f1, const struct input *f2, off_t common) {
+	struct list_job job = {
+		.f1 = f1, .f2 = f2,
+		.common = common,
+		.nchunks = (common + CHUNK_SIZE - 1) / CHUNK_SIZE,
+	};
+	if (!(job.chunks = calloc(job.nchunks, sizeof *job.chunks))) return -1;
+	pthread_mutex_init(&job.lock, NULL);
+	pthread_cond_init(&job.cond, NULL);
+
+	long nthreads = 0;
+	pthread_t *threads = malloc(opt.jobs * sizeof *threads);
+	for (; threads && nthreads < opt.jobs; nthreads++) {
+		if (pthread_create(&threads[nthreads], NULL, list_worker, &job)) break;
+	}
+
+	int ret = 0, err = nthreads ? 0 : ENOMEM;
+	for (size_t k = 0; !err && k < job.nchunks; k++) {
+		pthread_mutex_lock(&job.lock);
+		while (!job.chunks[k].done) pthread_cond_wait(&job.cond, &job.lock);
+		pthread_mutex_unlock(&job.lock);
+
+		struct chunk *c = &job.chunks[k];
+		if ((err = c->err)) break;
+		if (c->len) {
+			fwrite(c->out, 1, c->len, stdout);
+			ret = 1;
+		}
+		free(c->out);
+
+		pthread_mutex_lock(&job.lock);
+		job.written++;
+		pthread_cond_broadcast(&job.cond);
+		pthread_mutex_unlock(&job.lock);
+	}
+
+	pthread_mutex_lock(&job.lock);
+	job.stop = true;
+	pthread_cond_broadcast(&job.cond);
+	pthread_mutex_unlock(&job.lock);
+	for (long i = 0; i < nthreads; i++) pthread_join(threads[i], NULL);
+
+	for (size_t k = job.written; k < job.nchunks; k++) free(job.chunks[k].out);
+	free(job.chunks);
+	free(threads);
+	pthread_mutex_destroy(&job.lock);
+	pthread_cond_destroy(&job.cond);
+	if (err) return errno = err, -1;
+	return ret;
+}
+
+// }}}
+
+// Content hash cache {{{
+
+// With -x (or -X, which never writes), each whole regular file compared gets
+// its hash stored in an xattr, so files that differ can be told apart later
+// without reading them. Matching hashes still get a real comparison.
+#define CACHE_XATTR "user.uspace.cmp"
+
+// XXH64, streamed a window at a time
+struct hash {
+	uint64_t v[4], total;
+	unsigned char mem[32];
+	size_t memlen;
+	off_t pos; // How much of the file has been hashed
+};
+
+static const uint64_t P1 = 11400714785074694791ULL, P2 = 14029467366897019727ULL,
+	P3 = 1609587929392839161ULL, P4 = 9650029242287828579ULL, P5 = 2870177450012600261ULL;
+
+static uint64_t rotl64(uint64_t x, int r) {
+	return x << r | x >> (64 - r);
+}
+
+// The hash has to mean the same thing wherever the file ends up
+static uint64_t read64(const unsigned char *p) {
+	uint64_t v;
+	memcpy(&v, p, sizeof v);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap64(v);
+#endif
+	return v;
+}
+
+static uint32_t read32(const unsigned char *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof v);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap32(v);
+#endif
+	return v;
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t in) {
+	return rotl64(acc + in * P2, 31) * P1;
+}
+
+static uint64_t xxh_merge(uint64_t acc, uint64_t v) {
+	return (acc ^ xxh_round(0, v)) * P1 + P4;
+}
+
+static void hash_init(struct hash *h) {
+	memset(h, 0, sizeof *h);
+	h->v[0] = P1 + P2;
+	h->v[1] = P2;
+	h->v[2] = 0;
+	h->v[3] = -P1;
+}
+
+static void hash_stripe(struct hash *h, const unsigned char *p) {
+	for (int i = 0; i < 4; i++) h->v[i] = xxh_round(h->v[i], read64(p + 8*i));
+}
+
+static void hash_update(struct hash *h, const unsigned char *p, size_t n) {
+	h->total += n;
+	h->pos += n;
+	if (h->memlen) {
+		size_t take = sizeof h->mem - h->memlen;
+		if (take > n) take = n;
+		memcpy(h->mem + h->memlen, p, take);
+		h->memlen += take;
+		p += take;
+		n -= take;
+		if (h->memlen < sizeof h->mem) return;
+		hash_stripe(h, h->mem);
+		h->memlen = 0;
+	}
+	for (; n >= 32; p += 32, n -= 32) hash_stripe(h, p);
+	memcpy(h->mem, p, n);
+	h->memlen = n;
+}
+
+static uint64_t hash_digest(const struct hash *h) {
+	uint64_t acc = P5;
+	if (h->total >= 32) {
+		acc = rotl64(h->v[0], 1) + rotl64(h->v[1], 7) + rotl64(h->v[2], 12) + rotl64(h->v[3], 18);
+		for (int i = 0; i < 4; i++) acc = xxh_merge(acc, h->v[i]);
+	}
+	acc += h->total;
+
+	const unsigned char *p = h->mem;
+	size_t n = h->memlen;
+	for (; n >= 8; p += 8, n -= 8) acc = rotl64(acc ^ xxh_round(0, read64(p)), 27) * P1 + P4;
+	if (n >= 4) {
+		acc = rotl64(acc ^ read32(p) * P1, 23) * P2 + P3;
+		p += 4;
+		n -= 4;
+	}
+	for (; n; p++, n--) acc = rotl64(acc ^ *p * P5, 11) * P1;
+
+	acc ^= acc >> 33;
+	acc *= P2;
+	acc ^= acc >> 29;
+	acc *= P3;
+	acc ^= acc >> 32;
+	return acc;
+}
+
+// For holes that were skipped over rather than read
+static void hash_zeros(struct hash *h, off_t n) {
+	static const unsigned char zeros[BUFFER_SIZE];
+	for (; n > BUFFER_SIZE; n -= BUFFER_SIZE) hash_update(h, zeros, BUFFER_SIZE);
+	hash_update(h, zeros, n);
+}
+
+// Hashes whatever of the file the comparison didn't get to
+static int hash_rest(const struct input *in, struct hash *h) {
+	while (h->pos < in->st.st_size) {
+		size_t len = in->st.st_size - h->pos < WINDOW_SIZE ? in->st.st_size - h->pos : WINDOW_SIZE;
+		void *base;
+		size_t maplen;
+		const unsigned char *p = map_window(in, h->pos, len, &base, &maplen);
+		if (!p) return -1;
+		hash_update(h, p, len);
+		munmap(base, maplen);
+	}
+	return 0;
+}
+
+// A cached hash is only good for exactly the file it came from
+static void cache_key(const struct stat *st, char *buf, size_t len) {
+	snprintf(buf, len, "1 %jd %jd.%09ld %ju", (intmax_t)st->st_size,
+		(intmax_t)st->st_mtim.tv_sec, (long)st->st_mtim.tv_nsec, (uintmax_t)st->st_ino);
+}
+
+static bool cache_get(const struct input *in, uint64_t *hash) {
+#ifdef __linux__
+	char val[128], key[96];
+	ssize_t n = fgetxattr(in->fd, CACHE_XATTR, val, sizeof val - 1);
+	if (n < 0) return false;
+	val[n] = 0;
+
+	cache_key(&in->st, key, sizeof key);
+	size_t klen = strlen(key);
+	if (strncmp(val, key, klen) || val[klen] != ' ') return false;
+
+	char *end;
+	errno = 0;
+	*hash = strtoull(val + klen + 1, &end, 16);
+	return !errno && end != val + klen + 1 && !*end;
+#else
+	return false;
+#endif
+}
+
+static void cache_put(const struct input *in, uint64_t hash) {
+#ifdef __linux__
+	// Don't keep the hash of something that changed while we read it
+	struct stat st;
+	if (fstat(in->fd, &st)) return;
+	if (st.st_size != in->st.st_size || st.st_ino != in->st.st_ino ||
+			st.st_mtim.tv_sec != in->st.st_mtim.tv_sec ||
+			st.st_mtim.tv_nsec != in->st.st_mtim.tv_nsec) return;
+
+	char val[128];
+	cache_key(&st, val, sizeof val);
+	size_t len = strlen(val);
+	snprintf(val + len, sizeof val - len, " %016llx", (unsigned long long)hash);
+	// Best effort; plenty of files and filesystems won't take it
+	fsetxattr(in->fd, CACHE_XATTR, val, strlen(val), 0);
+#endif
+}
+
+// }}}
+
+// Gives up on mapping, putting the inputs back where cmp_streams expects
+// them after extent has moved them around
+static int unmapped(const struct input *f1, const struct input *f2) {
+	lseek(f1->fd, f1->off, SEEK_SET);
+	lseek(f2->fd, f2->off, SEEK_SET);
+	return -1;
+}
+
+// Compares two regular files through windows of mmap. Returns -1 if the
+// files can't be mapped, so they should be streamed instead.
+// The hashes, if given, are updated with the windows as they're compared
+static int cmp_mapped(struct input *f1, struct input *f2, struct hash *h1, struct hash *h2) {
+	off_t size1 = remaining(f1), size2 = remaining(f2);
+	off_t common = size1 < size2 ? size1 : size2;
+	struct cmp_state st = {0, 1, true};
+
+	// Only -l has to look at everything, so it's the only one worth splitting up
+	if (opt.list && opt.jobs > 1 && common > CHUNK_SIZE) {
+		int ret = list_parallel(f1, f2, common);
+		if (ret < 0) error("mmap: %s", f1->name);
+		st.identical = !ret;
+		st.byten = common;
+	}
+
+	// Sparse files are walked an extent at a time, so holes are never read
+	bool holes = sparse(f1) || sparse(f2);
+	for (off_t done = st.byten; done < common;) {
+		off_t end = common;
+		bool hole1 = false, hole2 = false;
+		if (holes) {
+			off_t end1, end2;
+			hole1 = extent(f1, f1->off + done, &end1);
+			hole2 = extent(f2, f2->off + done, &end2);
+			if (end1 - f1->off < end) end = end1 - f1->off;
+			if (end2 - f2->off < end) end = end2 - f2->off;
+			if (end <= done) {
+				// The file changed under us; read it like any other
+				end = common;
+				hole1 = hole2 = false;
 			}
-		} else if (c1 == '\n' && !opt.list) {
-			// Count lines
-			linen++;
+		}
+
+		if (hole1 && hole2) {
+			if (h1) hash_zeros(h1, end - done);
+			if (h2) hash_zeros(h2, end - done);
+			st.byten += end - done;
+			done = end;
+			continue;
+		}
+
+		size_t len = end - done < WINDOW_SIZE ? end - done : WINDOW_SIZE;
+		void *base1 = NULL, *base2 = NULL;
+		size_t maplen1, maplen2;
+		const unsigned char *p1 = NULL, *p2 = NULL;
+		if (!hole1 && !(p1 = map_window(f1, f1->off + done, len, &base1, &maplen1))) {
+			if (!done) return unmapped(f1, f2);
+			error("mmap: %s", f1->name);
+		}
+		if (!hole2 && !(p2 = map_window(f2, f2->off + done, len, &base2, &maplen2))) {
+			if (base1) munmap(base1, maplen1);
+			if (!done) return unmapped(f1, f2);
+			error("mmap: %s", f2->name);
+		}
+
+		bool differ = cmp_block(&st, p1, p2, len, f1->name, f2->name);
+		if (h1) p1 ? hash_update(h1, p1, len) : hash_zeros(h1, len);
+		if (h2) p2 ? hash_update(h2, p2, len) : hash_zeros(h2, len);
+		if (base1) munmap(base1, maplen1);
+		if (base2) munmap(base2, maplen2);
+		if (differ) return 1;
+		done += len;
+	}
+
+	if (size1 != size2) {
+		if (opt.list || !opt.silent) {
+			eprintf("cmp: EOF on %s after byte %zu\n", size1 < size2 ? f1->name : f2->name, st.byten + 1);
+		}
+		return 1;
+	}
+	return !st.identical;
+}
+
+static int do_cmp(const char *file1, const char *file2, uintmax_t skip1, uintmax_t skip2) {
+	struct input f1, f2;
+	if (open_input(&f1, file1, skip1)) error("fopen: %s", file1);
+	if (open_input(&f2, file2, skip2)) error("fopen: %s", file2);
+
+	int ret = -1;
+	if (f1.st.st_dev == f2.st.st_dev && f1.st.st_ino == f2.st.st_ino && f1.off == f2.off) {
+		// Anything is identical to itself
+		ret = 0;
+	} else if (sized(&f1) && sized(&f2)) {
+		// Hashes are of whole files
+		bool cacheable = opt.cache && remaining(&f1) == f1.st.st_size && remaining(&f2) == f2.st.st_size;
+		uint64_t c1, c2;
+		bool cached1 = cacheable && cache_get(&f1, &c1);
+		bool cached2 = cacheable && cache_get(&f2, &c2);
+
+		// Without -s we'd still need to find the first difference
+		if (opt.silent && !opt.list && (remaining(&f1) != remaining(&f2) || (cached1 && cached2 && c1 != c2))) {
+			ret = 1;
+		} else {
+			struct hash h1, h2, *hp1 = NULL, *hp2 = NULL;
+			if (cacheable && opt.cache_write) {
+				if (!cached1) hash_init(hp1 = &h1);
+				if (!cached2) hash_init(hp2 = &h2);
+			}
+
+			ret = cmp_mapped(&f1, &f2, hp1, hp2);
+			if (ret >= 0 && hp1 && !hash_rest(&f1, hp1)) cache_put(&f1, hash_digest(hp1));
+			if (ret >= 0 && hp2 && !hash_rest(&f2, hp2)) cache_put(&f2, hash_digest(hp2));
+		}
+	}
+	if (ret < 0) ret = cmp_streams(&f1, &f2);
+
+	close_input(&f1);
+	close_input(&f2);
+	return ret;
+}
+
+// Many candidates against one reference {{{
+
+// Each candidate is compared as do_cmp would compare it with the reference,
+// but the reference is only read once, for all of them together
+
+struct candidate {
+	struct input in;
+	struct cmp_state st;
+	int ret; // -1 while it still matches
+};
+
+// Compares the next n bytes of the reference with what c has to match them
+static int cmp_candidate(struct candidate *c, const struct input *ref, const unsigned char *p, size_t n) {
+	struct input *in = &c->in;
+	for (size_t done = 0; done < n;) {
+		if (refill(in)) error("read: %s", in->name);
+		size_t k = in->len - in->pos;
+		if (!k) {
+			if (!opt.silent) eprintf("cmp: EOF on %s after byte %zu\n", in->name, c->st.byten + 1);
+			return 1;
+		}
+		if (k > n - done) k = n - done;
+		if (cmp_block(&c->st, p + done, in->buf + in->pos, k, ref->name, in->name)) return 1;
+		in->pos += k;
+		done += k;
+	}
+	return -1;
+}
+
+// Once the reference runs out, whatever still matches must run out too
+static int cmp_candidate_end(struct candidate *c, const struct input *ref, bool eof) {
+	struct input *in = &c->in;
+	if (!eof) return 0; // Hit the limit
+	if (refill(in)) error("read: %s", in->name);
+	if (in->pos == in->len) return 0;
+	if (!opt.silent) eprintf("cmp: EOF on %s after byte %zu\n", ref->name, c->st.byten + 1);
+	return 1;
+}
+
+static int cmp_many(const char *reference, char *files[], int nfiles) {
+	struct input ref;
+	if (open_input(&ref, reference, 0)) error("fopen: %s", reference);
+
+	struct candidate *cands = calloc(nfiles, sizeof *cands);
+	if (!cands) error("calloc");
+	int live = 0;
+	for (int i = 0; i < nfiles; i++) {
+		struct candidate *c = &cands[i];
+		c->st = (struct cmp_state){0, 1, true};
+		c->ret = -1;
+		if (open_input(&c->in, files[i], 0)) {
+			c->ret = 2;
+			if (!opt.silent) perrorf("fopen: %s", files[i]);
+			continue;
+		}
+		if (c->in.st.st_dev == ref.st.st_dev && c->in.st.st_ino == ref.st.st_ino && c->in.off == ref.off) {
+			c->ret = 0;
+		} else if (opt.silent && sized(&ref) && sized(&c->in) && remaining(&ref) != remaining(&c->in)) {
+			c->ret = 1;
+		} else {
+			live++;
 		}
 	}
 
-#undef get1char
+	uintmax_t left = opt.limit;
+	bool eof = false;
+	while (live && left) {
+		if (refill(&ref)) {
+			if (!opt.silent) perrorf("read: %s", reference);
+			for (int i = 0; i < nfiles; i++) {
+				if (cands[i].ret < 0) cands[i].ret = 2;
+			}
+			live = 0;
+			break;
+		}
+		size_t n = ref.len - ref.pos;
+		if (!n) {
+			eof = true;
+			break;
+		}
+		if (n > left) n = left;
 
-	return !identical;
+		for (int i = 0; i < nfiles; i++) {
+			struct candidate *c = &cands[i];
+			if (c->ret >= 0) continue;
+			if ((c->ret = cmp_candidate(c, &ref, ref.buf + ref.pos, n)) >= 0) live--;
+		}
+		ref.pos += n;
+		left -= n;
+	}
+
+	int ret = 0;
+	for (int i = 0; i < nfiles; i++) {
+		struct candidate *c = &cands[i];
+		if (c->ret < 0) c->ret = cmp_candidate_end(c, &ref, eof);
+		if (c->ret > ret) ret = c->ret;
+		close_input(&c->in);
+	}
+	close_input(&ref);
+	free(cands);
+	return ret;
 }
 
+// }}}
+
 int main(int argc, char *argv[]) {
+	opt.jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (opt.jobs < 1) opt.jobs = 1;
+	opt.limit = UINTMAX_MAX;
+
 	int ch;
 	while ((ch = getopt(argc, argv, optstring)) >= 0) {
 		switch (ch) {
@@ -84,6 +821,38 @@ int main(int argc, char *argv[]) {
 			opt.silent = true;
 			break;
 
+		case 'x':
+			opt.cache = opt.cache_write = true;
+			break;
+
+		case 'X':
+			opt.cache = true;
+			opt.cache_write = false;
+			break;
+
+		case 'j': {
+			char *end;
+			opt.jobs = strtol(optarg, &end, 10);
+			if (*end || opt.jobs < 1) {
+				eprintf("jobs must be a positive number\n\n");
+				print_usage(*argv);
+				return 1;
+			}
+			break;
+		}
+
+		case 'm':
+			opt.many = true;
+			break;
+
+		case 'n':
+			if (parse_size(optarg, &opt.limit)) {
+				eprintf("limit must be a number of bytes\n\n");
+				print_usage(*argv);
+				return 1;
+			}
+			break;
+
 		case '?':
 		default:
 			print_usage(*argv);
@@ -91,11 +860,29 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
-	// Needs exactly 2 arguments
-	if (optind + 2 != argc) {
+	if (opt.many) {
+		// -l records don't say which candidate they're from
+		if (argc - optind < 2 || opt.list || opt.cache) {
+			print_usage(*argv);
+			return 1;
+		}
+		return cmp_many(argv[optind], argv + optind + 1, argc - optind - 1);
+	}
+
+	// Needs 2 files, optionally followed by how much to skip in each
+	if (argc - optind < 2 || argc - optind > 4) {
 		print_usage(*argv);
 		return 1;
 	}
 
-	return do_cmp(argv[optind], argv[optind+1]);
+	uintmax_t skip[2] = {0, 0};
+	for (int i = 0; optind + 2 + i < argc; i++) {
+		if (parse_size(argv[optind + 2 + i], &skip[i])) {
+			eprintf("skip must be a number of bytes\n\n");
+			print_usage(*argv);
+			return 1;
+		}
+	}
+
+	return do_cmp(argv[optind], argv[optind+1], skip[0], skip[1]);
 }
@@ -1,7 +1,11 @@
 // vim: noet
 
 #include "lib/utils.h"
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 const char *usage[] = {
 	"[string...]",
@@ -10,69 +14,90 @@ const char *usage[] = {
 
 _Bool print_nl = 1;
 
-static const char *echo_oct(const char *s) {
+static const char *echo_oct(const char *s, const char *end, char **out) {
 	int n = 0;
-	for (const char *end = s+3; *s && '0' <= *s && *s <= '7' && s < end; s++) {
+	for (const char *oct_end = s+3; s < end && '0' <= *s && *s <= '7' && s < oct_end; s++) {
 		n *= 8;
 		n += *s - '0';
 	}
-	putchar(n);
+	*(*out)++ = n;
 	return s;
 }
 
-static void echo_out(const char *s) {
-	while (*s) {
-		if (*s == '\\') {
-			s++;
-			if (!*s) break;
+// Expands s into out, which escapes never make longer. Returns the end of
+// what was written
+static char *echo_out(char *out, const char *s) {
+	const char *end = s + strlen(s);
+	while (s < end) {
+		// Everything up to the next backslash goes out as it is
+		const char *bs = memchr(s, '\\', end - s);
+		if (!bs) bs = end;
+		memcpy(out, s, bs - s);
+		out += bs - s;
+		s = bs + 1;
+		if (s >= end) break;
 
-			switch (*s) {
-			case 'a':
-				putchar('\a');
-				break;
-			case 'b':
-				putchar('\b');
-				break;
-			case 'c':
-				print_nl = 0;
-				break;
-			case 'f':
-				putchar('\f');
-				break;
-			case 'n':
-				putchar('\n');
-				break;
-			case 'r':
-				putchar('\r');
-				break;
-			case 't':
-				putchar('\t');
-				break;
-			case 'v':
-				putchar('\v');
-				break;
-			case '\\':
-			default:
-				putchar(*s);
-				break;
-			case '0':
-				s = echo_oct(s+1);
-				s--;
-				break;
-			}
-		} else {
-			putchar(*s);
+		switch (*s) {
+		case 'a':
+			*out++ = '\a';
+			break;
+		case 'b':
+			*out++ = '\b';
+			break;
+		case 'c':
+			print_nl = 0;
+			break;
+		case 'f':
+			*out++ = '\f';
+			break;
+		case 'n':
+			*out++ = '\n';
+			break;
+		case 'r':
+			*out++ = '\r';
+			break;
+		case 't':
+			*out++ = '\t';
+			break;
+		case 'v':
+			*out++ = '\v';
+			break;
+		case '\\':
+		default:
+			*out++ = *s;
+			break;
+		case '0':
+			s = echo_oct(s+1, end, &out);
+			continue;
 		}
 
 		s++;
 	}
+	return out;
 }
 
 int main(int argc, char *argv[]) {
+	// Each argument plus its separator or the newline
+	size_t size = 1;
+	for (int i = 1; i < argc; i++) size += strlen(argv[i]) + 1;
+	char *buf = malloc(size), *p = buf;
+	if (!buf) return perror("malloc"), 1;
+
 	for (int i = 1; i < argc; i++) {
-		echo_out(argv[i]);
-		if (i < argc - 1) putchar(' ');
+		p = echo_out(p, argv[i]);
+		if (i < argc - 1) *p++ = ' ';
+	}
+	if (print_nl) *p++ = '\n';
+
+	// All in one write, unless it comes up short
+	for (char *out = buf; out < p;) {
+		ssize_t n = write(STDOUT_FILENO, out, p - out);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			perror("write");
+			return 1;
+		}
+		out += n;
 	}
-	if (print_nl) putchar('\n');
 	return 0;
 }
@@ -1,84 +1,290 @@
 // vim: noet
 
 #include "lib/utils.h"
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 const char *usage[] = {
-	"[-i] [name=value]... [command [arg]...]",
+	"[-i] [-c] [name=value]... [command [arg]...]",
 	NULL,
 };
 
 extern char **environ;
 
-// clearenv(3) is not in POSIX.1 for some reason
-int clear_env(void) {
-	while (*environ) {
-		char *split = strchr(*environ, '=');
-		size_t len = split - *environ;
-		char name[len + 1];
-		strncpy(name, *environ, len);
-		name[len] = 0;
-		if (unsetenv(name)) return 1;
+// The new environment, built up without touching our own
+struct env {
+	char **vars;
+	size_t len;
+	// Open-addressed set of indices into vars, keyed by name
+	size_t *slots, mask;
+};
+
+static const size_t EMPTY = (size_t)-1;
+
+static size_t name_len(const char *var) {
+	const char *eq = strchr(var, '=');
+	return eq ? (size_t)(eq - var) : strlen(var);
+}
+
+// FNV-1a
+static size_t name_hash(const char *name, size_t len) {
+	size_t h = 2166136261u;
+	for (size_t i = 0; i < len; i++) {
+		h ^= (unsigned char)name[i];
+		h *= 16777619u;
 	}
+	return h;
+}
+
+static int env_init(struct env *e, size_t max) {
+	size_t nslots = 8;
+	while (nslots < max * 2) nslots *= 2;
+	e->vars = malloc((max + 1) * sizeof *e->vars);
+	e->slots = malloc(nslots * sizeof *e->slots);
+	if (!e->vars || !e->slots) return -1;
+	for (size_t i = 0; i < nslots; i++) e->slots[i] = EMPTY;
+	e->mask = nslots - 1;
+	e->len = 0;
+	e->vars[0] = NULL;
 	return 0;
 }
 
+// Finds the slot holding name, or the empty one where it would go
+static size_t *env_slot(const struct env *e, const char *name, size_t len) {
+	for (size_t i = name_hash(name, len);; i++) {
+		size_t *slot = &e->slots[i & e->mask];
+		if (*slot == EMPTY) return slot;
+		const char *var = e->vars[*slot];
+		if (name_len(var) == len && !memcmp(var, name, len)) return slot;
+	}
+}
+
+// Same as putenv: replaces the variable in place if it's already set,
+// otherwise appends it
+static void env_put(struct env *e, char *var) {
+	size_t *slot = env_slot(e, var, name_len(var));
+	if (*slot == EMPTY) {
+		*slot = e->len;
+		e->vars[e->len++] = var;
+		e->vars[e->len] = NULL;
+	} else {
+		e->vars[*slot] = var;
+	}
+}
+
+static char *env_get(const struct env *e, const char *name) {
+	size_t len = strlen(name);
+	size_t slot = *env_slot(e, name, len);
+	if (slot == EMPTY) return NULL;
+	char *var = e->vars[slot];
+	return var[len] ? var + len + 1 : var + len;
+}
+
+// PATH cache {{{
+
+// With -c, where each command was found on PATH is remembered in a table
+// under $XDG_CACHE_HOME, so next time it can be run without trying every
+// directory before it. An entry is only trusted while none of the
+// directories up to and including the one it names have changed
+
+enum {CACHE_SLOTS = 4096};
+
+struct cache_slot {
+	uint64_t key; // Of PATH and the command
+	uint64_t stamp; // Of the directories searched
+	uint64_t check; // Of everything, against torn writes from other envs
+	uint32_t index; // Into PATH
+	uint32_t unused;
+};
+
+struct cache {
+	char magic[8];
+	struct cache_slot slots[CACHE_SLOTS];
+};
+
+static const char CACHE_MAGIC[8] = "uspenv1";
+
+// FNV-1a
+static uint64_t fnv(uint64_t h, const void *p, size_t n) {
+	for (const unsigned char *c = p; n--; c++) {
+		h ^= *c;
+		h *= 1099511628211u;
+	}
+	return h;
+}
+
+static const uint64_t FNV_BASIS = 14695981039346656037u;
+
+static uint64_t cache_key(const char *path, const char *name) {
+	return fnv(fnv(FNV_BASIS, path, strlen(path) + 1), name, strlen(name));
+}
+
+static uint64_t cache_check(const struct cache_slot *slot) {
+	uint64_t h = fnv(~FNV_BASIS, &slot->key, sizeof slot->key);
+	h = fnv(h, &slot->stamp, sizeof slot->stamp);
+	return fnv(h, &slot->index, sizeof slot->index);
+}
+
+// Folds a directory into the stamp of those before it. Ones that don't
+// exist count too, since they might later
+static uint64_t dir_stamp(uint64_t stamp, const char *dir) {
+	struct stat st;
+	uint64_t id[4] = {0, 0, 0, 0};
+	if (!stat(dir, &st)) {
+		id[0] = st.st_dev;
+		id[1] = st.st_ino;
+		id[2] = st.st_mtim.tv_sec;
+		id[3] = st.st_mtim.tv_nsec;
+	}
+	return fnv(stamp, id, sizeof id);
+}
+
+static struct cache *cache_open(void) {
+	const char *base = getenv("XDG_CACHE_HOME"), *sub = "/uspace";
+	if (!base || *base != '/') {
+		base = getenv("HOME");
+		sub = "/.cache/uspace";
+		if (!base) return NULL;
+	}
+
+	char file[strlen(base) + strlen(sub) + sizeof "/env"];
+	sprintf(file, "%s%s", base, sub);
+	// The cache directory might not exist yet, or even its parents
+	for (char *p = file + 1;; p++) {
+		if (*p && *p != '/') continue;
+		char c = *p;
+		*p = 0;
+		if (mkdir(file, 0755) && errno != EEXIST) return NULL;
+		if (!(*p = c)) break;
+	}
+	strcat(file, "/env");
+
+	int fd = open(file, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) return NULL;
+	struct stat st;
+	if (fstat(fd, &st) || (st.st_size != sizeof(struct cache) && ftruncate(fd, sizeof(struct cache)))) {
+		close(fd);
+		return NULL;
+	}
+	struct cache *cache = mmap(NULL, sizeof *cache, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (cache == MAP_FAILED) return NULL;
+
+	if (memcmp(cache->magic, CACHE_MAGIC, sizeof CACHE_MAGIC)) {
+		memset(cache, 0, sizeof *cache);
+		memcpy(cache->magic, CACHE_MAGIC, sizeof CACHE_MAGIC);
+	}
+	return cache;
+}
+
+static struct cache_slot *cache_slot(struct cache *cache, uint64_t key) {
+	return &cache->slots[key % CACHE_SLOTS];
+}
+
+static void cache_put(struct cache_slot *slot, uint64_t key, uint64_t stamp, uint32_t index) {
+	slot->key = key;
+	slot->stamp = stamp;
+	slot->index = index;
+	slot->check = cache_check(slot);
+}
+
+// Runs the command from where it was found last time, if that's still right.
+// Returns if it isn't, or if it couldn't be run from there
+static void cache_exec(struct cache_slot *slot, uint64_t key, const char *path_env, char **argv, char **envp) {
+	struct cache_slot s = *slot;
+	if (s.key != key || s.check != cache_check(&s)) return;
+
+	char *path = strdup(path_env);
+	if (!path) return;
+	uint64_t stamp = FNV_BASIS;
+	char *dir = strtok(path, ":");
+	for (uint32_t i = 0; dir; i++, dir = strtok(NULL, ":")) {
+		stamp = dir_stamp(stamp, dir);
+		if (i < s.index) continue;
+		if (stamp != s.stamp) break;
+
+		char file[strlen(dir) + strlen(*argv) + 2];
+		sprintf(file, "%s/%s", dir, *argv);
+		execve(file, argv, envp);
+		break;
+	}
+	free(path);
+}
+
+// }}}
+
 int main(int argc, char **argv) {
 	const char *argv0 = *argv;
 
 	--argc, ++argv;
 
-	char *path = NULL;
-	{
-		char *path_env = getenv("PATH");
-		if (path_env) {
-			// By spec, this can we overwritten by subsequent getenv calls, so
-			// we need to copy the string
-			path = malloc(strlen(path_env) + 1);
-			strcpy(path, path_env);
-		}
+	bool clear = false, use_cache = false;
+	for (; argc; --argc, ++argv) {
+		if (!strcmp(*argv, "-i")) clear = true;
+		else if (!strcmp(*argv, "-c")) use_cache = true;
+		else break;
 	}
 
-	if (argc && !strcmp(*argv, "-i")) {
-		--argc, ++argv;
-		if (clear_env()) {
-			eprintf("%s: Failed to clear environment\n", argv0);
-			exit(1);
-		}
+	size_t nassign = 0, nenv = 0;
+	while (nassign < (size_t)argc && strchr(argv[nassign], '=')) nassign++;
+	if (!clear) {
+		while (environ[nenv]) nenv++;
 	}
 
-	for (; argc; --argc, ++argv) {
-		if (!strchr(*argv, '=')) break;
-		putenv(*argv);
+	struct env env;
+	if (env_init(&env, nenv + nassign)) {
+		perrorf("%s: malloc", argv0);
+		return 1;
 	}
-
-	// PATH may have changed; we should use the new one if it exists
-	{
-		char *path_env = getenv("PATH");
-		// We don't need to copy this time as we never getenv again
-		if (path_env) {
-			free(path);
-			path = path_env;
-		}
+	for (size_t i = 0; i < nenv; i++) {
+		// With duplicates, only the first is ever seen by getenv
+		size_t *slot = env_slot(&env, environ[i], name_len(environ[i]));
+		if (*slot == EMPTY) *slot = env.len;
+		env.vars[env.len++] = environ[i];
 	}
+	env.vars[env.len] = NULL;
+	for (; nassign; --nassign, --argc, ++argv) env_put(&env, *argv);
 
 	if (!argc) {
-		for (char **env = environ; *env; ++env) {
-			puts(*env);
+		for (char **var = env.vars; *var; ++var) {
+			puts(*var);
 		}
 		return 0;
+	}
+
+	if (strchr(*argv, '/')) {
+		execve(*argv, argv, env.vars);
 	} else {
-		if (strchr(*argv, '/')) {
-			execv(*argv, argv);
+		// PATH may have changed; we should use the new one if it exists
+		char *path_env = env_get(&env, "PATH");
+		if (!path_env) path_env = getenv("PATH");
+		// strtok writes into it, and it may be part of the new environment
+		char *path = path_env ? strdup(path_env) : NULL;
+
+		if (!path_env) {
+			errno = ENOENT;
 		} else if (path) {
+			struct cache *cache = use_cache ? cache_open() : NULL;
+			struct cache_slot *slot = NULL;
+			uint64_t key = 0, stamp = FNV_BASIS;
+			if (cache) {
+				key = cache_key(path_env, *argv);
+				slot = cache_slot(cache, key);
+				cache_exec(slot, key, path_env, argv, env.vars);
+			}
+
 			char *name = *argv;
 			size_t name_len = strlen(*argv);
 			char *dir = strtok(path, ":");
-			while (dir) {
+			for (uint32_t i = 0; dir; i++) {
 				size_t dir_len = strlen(dir);
 
 				size_t len = dir_len + name_len + 1;
@@ -90,17 +296,24 @@ int main(int argc, char **argv) {
 				strcpy(path + dir_len + 1, name);
 				path[len] = 0;
 
-				execv(path, argv);
+				// There's no coming back to record it if it works
+				if (slot) {
+					stamp = dir_stamp(stamp, dir);
+					cache_put(slot, key, stamp, i);
+				}
+				execve(path, argv, env.vars);
 
 				if (errno != ENOENT) break;
 
 				dir = strtok(NULL, ":");
 			}
+			// Don't send the next run somewhere that didn't work
+			if (slot) slot->key = 0;
 		}
+	}
 
-		perrorf("%s: '%s'", argv0, *argv);
+	perrorf("%s: '%s'", argv0, *argv);
 
-		if (errno == ENOENT) return 127;
-		else return 126;
-	}
+	if (errno == ENOENT) return 127;
+	else return 126;
 }
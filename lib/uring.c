@@ -0,0 +1,133 @@
+// vim: noet
+
+#define _GNU_SOURCE
+#include "uring.h"
+
+#ifdef __linux__
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+int uring_init(struct uring *r, unsigned entries) {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof p);
+	memset(r, 0, sizeof *r);
+
+	r->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (r->fd < 0) return -1;
+	r->sq_entries = p.sq_entries;
+	r->cq_entries = p.cq_entries;
+
+	r->sq_len = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+	r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+	// Newer kernels share one mapping between both rings
+	bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+	if (single && r->cq_len > r->sq_len) r->sq_len = r->cq_len;
+
+	r->sq_map = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_map == MAP_FAILED) goto fail;
+	if (single) {
+		r->cq_map = r->sq_map;
+	} else {
+		r->cq_map = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if (r->cq_map == MAP_FAILED) goto fail;
+	}
+	r->sqes = mmap(NULL, p.sq_entries * sizeof *r->sqes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) goto fail;
+
+	char *sq = r->sq_map, *cq = r->cq_map;
+	r->sq_head = (unsigned *)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)(sq + p.sq_off.array);
+	r->cq_head = (unsigned *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return 0;
+
+fail:;
+	int err = errno;
+	if (r->sqes == MAP_FAILED) r->sqes = NULL;
+	if (r->cq_map == MAP_FAILED) r->cq_map = NULL;
+	if (r->sq_map == MAP_FAILED) r->sq_map = NULL;
+	uring_free(r);
+	errno = err;
+	return -1;
+}
+
+void uring_free(struct uring *r) {
+	if (r->sqes) munmap(r->sqes, r->sq_entries * sizeof *r->sqes);
+	if (r->cq_map && r->cq_map != r->sq_map) munmap(r->cq_map, r->cq_len);
+	if (r->sq_map) munmap(r->sq_map, r->sq_len);
+	close(r->fd);
+	memset(r, 0, sizeof *r);
+	r->fd = -1;
+}
+
+bool uring_supports(struct uring *r, int op) {
+	enum {NOPS = 256};
+	struct io_uring_probe *probe = calloc(1, sizeof *probe + NOPS * sizeof *probe->ops);
+	if (!probe) return false;
+
+	bool ret = false;
+	if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PROBE, probe, NOPS) == 0) {
+		ret = op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+	}
+	free(probe);
+	return ret;
+}
+
+struct io_uring_sqe *uring_sqe(struct uring *r) {
+	unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	unsigned tail = *r->sq_tail;
+	if (tail - head >= r->sq_entries) return NULL;
+
+	unsigned idx = tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[idx];
+	memset(sqe, 0, sizeof *sqe);
+	r->sq_array[idx] = idx;
+	// The kernel only looks at this during io_uring_enter, so it's fine to
+	// publish the entry before the caller has filled it in
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	r->queued++;
+	return sqe;
+}
+
+int uring_submit(struct uring *r, unsigned wait_nr) {
+	unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+	for (;;) {
+		int ret = syscall(__NR_io_uring_enter, r->fd, r->queued, wait_nr, flags, NULL, 0);
+		if (ret < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		r->queued -= ret;
+		return ret;
+	}
+}
+
+struct io_uring_cqe *uring_cqe(struct uring *r) {
+	unsigned head = *r->cq_head;
+	if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+	return &r->cqes[head & *r->cq_mask];
+}
+
+struct io_uring_cqe *uring_wait(struct uring *r) {
+	struct io_uring_cqe *cqe;
+	while (!(cqe = uring_cqe(r))) {
+		if (uring_submit(r, 1) < 0) return NULL;
+	}
+	return cqe;
+}
+
+void uring_seen(struct uring *r) {
+	__atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+#else
+typedef int uring_unsupported;
+#endif
@@ -0,0 +1,42 @@
+// vim: noet
+
+#ifndef _USPACE_URING_H
+#define _USPACE_URING_H
+
+#ifdef __linux__
+#include <stdbool.h>
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+// Just enough io_uring to batch up syscalls; no SQPOLL, so SQEs are only
+// read by the kernel during uring_submit
+struct uring {
+	int fd;
+	unsigned sq_entries, cq_entries;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned queued; // Prepared but not yet submitted
+
+	void *sq_map, *cq_map;
+	size_t sq_len, cq_len;
+};
+
+int uring_init(struct uring *r, unsigned entries);
+void uring_free(struct uring *r);
+// Checks whether the kernel knows about an IORING_OP_*
+bool uring_supports(struct uring *r, int op);
+
+// Returns a zeroed SQE, or NULL if the submission queue is full
+struct io_uring_sqe *uring_sqe(struct uring *r);
+// Submits everything queued and waits for at least wait_nr completions
+int uring_submit(struct uring *r, unsigned wait_nr);
+// Returns the next completion without blocking, or NULL if there is none
+struct io_uring_cqe *uring_cqe(struct uring *r);
+// Like uring_cqe, but submits and blocks until there is a completion
+struct io_uring_cqe *uring_wait(struct uring *r);
+void uring_seen(struct uring *r);
+#endif
+
+#endif
@@ -1,7 +1,9 @@
 // vim: noet
 
 #include "utils.h"
+#include <ctype.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <string.h>
 #include <stdarg.h>
 #include <stdlib.h>
@@ -64,3 +66,28 @@ unsigned long log10li(unsigned long x) {
 	while (x /= 10) ++i;
 	return i;
 }
+
+int parse_size(const char *s, uintmax_t *out) {
+	// strtoumax quietly negates negative numbers
+	if (!isdigit((unsigned char)*s)) return errno = EINVAL, -1;
+
+	char *end;
+	errno = 0;
+	uintmax_t n = strtoumax(s, &end, 10);
+	if (errno) return -1;
+
+	unsigned shift = 0;
+	switch (*end) {
+	case 'T': case 't': shift += 10; // fallthrough
+	case 'G': case 'g': shift += 10; // fallthrough
+	case 'M': case 'm': shift += 10; // fallthrough
+	case 'K': case 'k': shift += 10;
+		end++;
+		break;
+	}
+	if (*end) return errno = EINVAL, -1;
+	if (n > UINTMAX_MAX >> shift) return errno = ERANGE, -1;
+
+	*out = n << shift;
+	return 0;
+}
@@ -3,6 +3,7 @@
 #ifndef _USPACE_UTILS_H
 #define _USPACE_UTILS_H
 
+#include <stdint.h>
 #include <stdio.h>
 #define eprintf(...) fprintf(stderr, __VA_ARGS__)
 
@@ -17,4 +18,7 @@ int asprintf(char **strp, const char *fmt, ...);
 
 unsigned long log10li(unsigned long x);
 
+// Parses a count with an optional K, M, G or T (binary) suffix
+int parse_size(const char *s, uintmax_t *out);
+
 #endif
@@ -1,26 +1,134 @@
 // vim: noet
 
+#define _GNU_SOURCE
 #include "lib/utils.h"
+#include "lib/uring.h"
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/time.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
-#include <limits.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 
 const char *usage[] = {
-	"[-iRr] file...",
-	"-f [-iRr] [file...]",
+	"[-AiORru] [-S|-J] [-j jobs] file...",
+	"-f [-AiORru] [-S|-J] [-j jobs] [file...]",
 	NULL,
 };
 
-const char *optstring = "fiRr";
+const char *optstring = "AfiORruSJj:";
 struct rm_options {
-	bool force, confirm, recurse;
+	bool force, confirm, recurse, uring, sort, async;
+	long jobs;
+	enum {STATS_NONE, STATS_TEXT, STATS_JSON} stats;
 } opt = {0};
 bool stdin_is_term = false;
 
+// Stats {{{
+
+// With -S or -J, what rm did is counted up and reported at exit. The
+// counters are relaxed atomics, since -j workers share them, and cost a
+// branch when they're off, so they don't change what they measure.
+// Syscalls are counted where they're made. Only what was stat'd anyway
+// counts towards the bytes freed, so with d_type that's a lower bound,
+// often just the operands
+
+struct rm_stats {
+	unsigned long long files, dirs, bytes, errors;
+	unsigned long long openat, fstat, fstatat, getdents64, unlinkat, rmdir, faccessat, close;
+	unsigned long long uring_enter, uring_unlinkat;
+} stats = {0};
+
+#define COUNT(field, n) (opt.stats ? (void)__atomic_fetch_add(&stats.field, (n), __ATOMIC_RELAXED) : (void)0)
+
+static double seconds(struct timeval tv) {
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void stats_report(const struct timespec *start) {
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double wall = (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+	struct rusage ru = {0};
+	getrusage(RUSAGE_SELF, &ru);
+	double user = seconds(ru.ru_utime), sys = seconds(ru.ru_stime);
+	double rate = wall > 0 ? (stats.files + stats.dirs) / wall : 0;
+
+	if (opt.stats == STATS_JSON) {
+		printf("{\"files\": %llu, \"dirs\": %llu, \"bytes_freed_at_least\": %llu, \"errors\": %llu, "
+				"\"syscalls\": {\"openat\": %llu, \"fstat\": %llu, \"fstatat\": %llu, \"getdents64\": %llu, "
+				"\"unlinkat\": %llu, \"rmdir\": %llu, \"faccessat\": %llu, \"close\": %llu, "
+				"\"io_uring_enter\": %llu}, \"io_uring_unlinkat\": %llu, "
+				"\"wall_seconds\": %.3f, \"user_seconds\": %.3f, \"sys_seconds\": %.3f, "
+				"\"entries_per_second\": %.0f}\n",
+				stats.files, stats.dirs, stats.bytes, stats.errors,
+				stats.openat, stats.fstat, stats.fstatat, stats.getdents64,
+				stats.unlinkat, stats.rmdir, stats.faccessat, stats.close,
+				stats.uring_enter, stats.uring_unlinkat,
+				wall, user, sys, rate);
+	} else {
+		eprintf("rm: removed %llu files and %llu directories, freeing at least %llu bytes\n", stats.files, stats.dirs, stats.bytes);
+		eprintf("rm: syscalls: openat %llu, fstat %llu, fstatat %llu, getdents64 %llu, unlinkat %llu, rmdir %llu, "
+				"faccessat %llu, close %llu, io_uring_enter %llu\n",
+				stats.openat, stats.fstat, stats.fstatat, stats.getdents64, stats.unlinkat, stats.rmdir,
+				stats.faccessat, stats.close, stats.uring_enter);
+		if (stats.uring_unlinkat) eprintf("rm: io_uring unlinkat %llu\n", stats.uring_unlinkat);
+		eprintf("rm: %llu errors, %.3fs wall, %.3fs user, %.3fs sys, %.0f entries/s\n", stats.errors, wall, user, sys, rate);
+	}
+}
+
+// The syscalls that are counted
+static int rm_openat(int dirfd, const char *name, int flags) {
+	COUNT(openat, 1);
+	return openat(dirfd, name, flags);
+}
+
+static int rm_fstat(int fd, struct stat *st) {
+	COUNT(fstat, 1);
+	return fstat(fd, st);
+}
+
+static int rm_close(int fd) {
+	COUNT(close, 1);
+	return close(fd);
+}
+
+static int rm_fstatat(int dirfd, const char *name, struct stat *st, int flags) {
+	COUNT(fstatat, 1);
+	return fstatat(dirfd, name, st, flags);
+}
+
+static int rm_faccessat(int dirfd, const char *name, int mode, int flags) {
+	COUNT(faccessat, 1);
+	return faccessat(dirfd, name, mode, flags);
+}
+
+static int rm_unlinkat(int dirfd, const char *name, int flags) {
+	int ret = unlinkat(dirfd, name, flags);
+	if (flags & AT_REMOVEDIR) {
+		COUNT(rmdir, 1);
+		if (!ret) COUNT(dirs, 1);
+	} else {
+		COUNT(unlinkat, 1);
+		if (!ret) COUNT(files, 1);
+	}
+	return ret;
+}
+
+// }}}
+
 static bool confirm(void) {
 	int c = getchar(), c2 = c; // Save the first char
 	while (c2 != EOF && c2 != '\n') c2 = getchar(); // Discard the rest of the line
@@ -33,60 +141,1278 @@ static bool confirm(void) {
 	}
 }
 
-static int do_rm(const char *fn) {
-	char cwd[PATH_MAX];
-	if (!getcwd(cwd, sizeof cwd)) return perror("getcwd"), 1;
+// Where an entry is, relative to the operand it came from. It's only turned
+// into a string when there's something to say about it
+struct rm_path {
+	const struct rm_path *parent;
+	const char *name;
+};
+
+static char *path_str(const struct rm_path *path) {
+	size_t len = 0;
+	for (const struct rm_path *p = path; p; p = p->parent) len += strlen(p->name) + 1;
+	char *s = len ? malloc(len) : NULL;
+	if (!s) return NULL;
+	// Fill it in backwards, since that's the way the links go
+	char *end = s + len - 1;
+	*end = 0;
+	for (const struct rm_path *p = path; p; p = p->parent) {
+		size_t n = strlen(p->name);
+		end -= n;
+		memcpy(end, p->name, n);
+		if (p->parent) *--end = '/';
+	}
+	return s;
+}
+
+// perror for a path
+static void path_error(const struct rm_path *path) {
+	int err = errno;
+	COUNT(errors, 1);
+	char *s = path_str(path);
+	errno = err;
+	perror(s ? s : path->name);
+	free(s);
+}
+
+static bool path_confirm(const char *fmt, const struct rm_path *path) {
+	char *s = path_str(path);
+	eprintf(fmt, s ? s : path->name);
+	free(s);
+	return confirm();
+}
+
+// What readdir says an entry is, as far as we care: 0 if we need to stat
+// it to find out
+static mode_t entry_type(int d_type) {
+#ifdef DT_UNKNOWN
+	switch (d_type) {
+	case DT_DIR: return S_IFDIR;
+	case DT_LNK: return S_IFLNK;
+	case DT_UNKNOWN: return 0;
+	default: return S_IFREG; // Anything else is just unlinked
+	}
+#else
+	(void)d_type;
+	return 0;
+#endif
+}
+
+// Directory streams {{{
+
+// Under Linux, directories are read with getdents64 directly, so the calls
+// can be counted; anywhere else, it's readdir
+
+// An entry as the walk sees it
+struct rm_entry {
+	ino_t ino;
+	mode_t type;
+	size_t off; // Of the name in the chunk, while it's being read
+	const char *name;
+};
+
+struct rm_stream {
+	int fd;
+#ifdef __linux__
+	size_t pos, len;
+	uint64_t buf[4096]; // 32K, aligned for the dirents in it
+#else
+	DIR *dp;
+#endif
+};
+
+#ifdef __linux__
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+#endif
+
+// Takes fd over, unless it fails
+static struct rm_stream *stream_open(int fd) {
+	struct rm_stream *s = malloc(sizeof *s);
+	if (!s) return NULL;
+	s->fd = fd;
+#ifdef __linux__
+	s->pos = s->len = 0;
+#else
+	if (!(s->dp = fdopendir(fd))) {
+		int err = errno;
+		free(s);
+		errno = err;
+		return NULL;
+	}
+#endif
+	return s;
+}
+
+static void stream_close(struct rm_stream *s) {
+	COUNT(close, 1);
+#ifdef __linux__
+	close(s->fd);
+#else
+	closedir(s->dp);
+#endif
+	free(s);
+}
+
+static void stream_rewind(struct rm_stream *s) {
+#ifdef __linux__
+	lseek(s->fd, 0, SEEK_SET);
+	s->pos = s->len = 0;
+#else
+	rewinddir(s->dp);
+#endif
+}
+
+// The next entry but "." and "..", which is good until the one after. At
+// the end, errno is nonzero if reading failed
+static bool stream_next(struct rm_stream *s, struct rm_entry *e) {
+#ifdef __linux__
+	for (;;) {
+		if (s->pos == s->len) {
+			COUNT(getdents64, 1);
+			long n = syscall(SYS_getdents64, s->fd, s->buf, sizeof s->buf);
+			if (n <= 0) {
+				if (!n) errno = 0;
+				return false;
+			}
+			s->pos = 0;
+			s->len = n;
+		}
+		struct linux_dirent64 *de = (struct linux_dirent64 *)((char *)s->buf + s->pos);
+		s->pos += de->d_reclen;
+		if (!strcmp(de->d_name, ".")) continue;
+		if (!strcmp(de->d_name, "..")) continue;
+		*e = (struct rm_entry){de->d_ino, entry_type(de->d_type), 0, de->d_name};
+		return true;
+	}
+#else
+	struct dirent *de;
+	while ((errno = 0, de = readdir(s->dp))) {
+		if (!strcmp(de->d_name, ".")) continue;
+		if (!strcmp(de->d_name, "..")) continue;
+#ifdef DT_UNKNOWN
+		*e = (struct rm_entry){de->d_ino, entry_type(de->d_type), 0, de->d_name};
+#else
+		*e = (struct rm_entry){de->d_ino, 0, 0, de->d_name};
+#endif
+		return true;
+	}
+	return false;
+#endif
+}
+
+// }}}
+
+// Inodes of entries that are still there after we tried, so they can be
+// skipped if their directory is read again
+struct rm_kept {
+	ino_t *inos;
+	size_t len, cap;
+};
+
+static void keep(struct rm_kept *k, ino_t ino) {
+	if (k->len == k->cap) {
+		size_t cap = k->cap ? k->cap * 2 : 16;
+		ino_t *inos = realloc(k->inos, cap * sizeof *inos);
+		// At worst, it gets tried again
+		if (!inos) return;
+		k->inos = inos;
+		k->cap = cap;
+	}
+	k->inos[k->len++] = ino;
+}
+
+static bool kept(const struct rm_kept *k, ino_t ino) {
+	for (size_t i = 0; i < k->len; i++) {
+		if (k->inos[i] == ino) return true;
+	}
+	return false;
+}
+
+// What rm_check did with an entry
+enum {RM_GONE, RM_FAILED, RM_KEPT, RM_DIR};
+
+static int rm_check(int dirfd, const struct rm_path *path, mode_t type);
+static int rm_at(int dirfd, const struct rm_path *path, mode_t type);
+
+#ifdef __linux__
+// Batched unlinking {{{
+
+// With -u, the files in a directory are unlinked through io_uring, a batch
+// at a time. Directories still go one by one, since everything in them has
+// to go first, so the batch is flushed before each
+
+enum {URING_ENTRIES = 256};
+
+static struct uring ring;
+static bool use_uring = false;
+
+static struct {
+	int dirfd;
+	const struct rm_path *parent;
+	struct rm_kept *kept;
+	unsigned len;
+	ino_t inos[URING_ENTRIES];
+	char names[URING_ENTRIES][NAME_MAX + 1];
+} batch;
+
+static bool uring_setup(void) {
+	if (uring_init(&ring, URING_ENTRIES)) return false;
+	if (uring_supports(&ring, IORING_OP_UNLINKAT)) return true;
+	uring_free(&ring);
+	return false;
+}
+
+static void batch_flush(void) {
+	if (!batch.len) return;
+	int res[URING_ENTRIES];
+	for (unsigned i = 0; i < batch.len; i++) res[i] = 1; // No result yet
+
+	unsigned got = 0;
+	COUNT(uring_enter, 1);
+	if (uring_submit(&ring, batch.len) >= 0) {
+		for (; got < batch.len; got++) {
+			// Like uring_wait, but counting the waits
+			struct io_uring_cqe *cqe;
+			while (!(cqe = uring_cqe(&ring))) {
+				COUNT(uring_enter, 1);
+				if (uring_submit(&ring, 1) < 0) break;
+			}
+			if (!cqe) break;
+			res[cqe->user_data] = cqe->res;
+			uring_seen(&ring);
+		}
+	}
+	COUNT(uring_unlinkat, got);
+	// The ring can't be trusted with anything else once it's gone wrong
+	if (got < batch.len) use_uring = false;
+
+	// Anything left over has to go the slow way, which may well need the
+	// batch again
+	unsigned len = batch.len;
+	int dirfd = batch.dirfd;
+	const struct rm_path *parent = batch.parent;
+	struct rm_kept *k = batch.kept;
+	batch.len = 0;
+	char *retry[URING_ENTRIES];
+	ino_t retry_inos[URING_ENTRIES];
+	unsigned nretry = 0;
+	for (unsigned i = 0; i < len; i++) {
+		struct rm_path path = {parent, batch.names[i]};
+		if (res[i] == 1 || res[i] == -EISDIR) {
+			retry_inos[nretry] = batch.inos[i];
+			if ((retry[nretry] = strdup(batch.names[i]))) nretry++;
+			else if (rm_at(dirfd, &path, 0)) keep(k, batch.inos[i]);
+		} else if (res[i] >= 0) {
+			COUNT(files, 1);
+		} else if (!opt.force || res[i] != -ENOENT) {
+			errno = -res[i];
+			path_error(&path);
+			keep(k, batch.inos[i]);
+		}
+	}
+	for (unsigned i = 0; i < nretry; i++) {
+		if (rm_at(dirfd, &(struct rm_path){parent, retry[i]}, 0)) keep(k, retry_inos[i]);
+		free(retry[i]);
+	}
+}
+
+static void batch_unlink(int dirfd, const struct rm_path *parent, struct rm_kept *k, ino_t ino, const char *name) {
+	if (batch.len && batch.dirfd != dirfd) batch_flush();
+	struct io_uring_sqe *sqe = batch.len < URING_ENTRIES ? uring_sqe(&ring) : NULL;
+	if (!sqe) {
+		batch_flush();
+		sqe = uring_sqe(&ring);
+	}
+	if (!sqe) {
+		if (rm_at(dirfd, &(struct rm_path){parent, name}, 0)) keep(k, ino);
+		return;
+	}
 
+	batch.dirfd = dirfd;
+	batch.parent = parent;
+	batch.kept = k;
+	unsigned i = batch.len++;
+	batch.inos[i] = ino;
+	strcpy(batch.names[i], name);
+	sqe->opcode = IORING_OP_UNLINKAT;
+	sqe->fd = dirfd;
+	sqe->addr = (uintptr_t)batch.names[i];
+	sqe->user_data = i;
+}
+
+// }}}
+#endif
+
+// Iterative removal {{{
+
+// Trees are walked with a stack of frames on the heap, rather than the C
+// stack, so depth is only limited by memory. Only the deepest few
+// directories are kept open; the rest are closed and then reopened through
+// ".." on the way back up, checking they're still the same directory
+
+enum {MAX_OPEN_DIRS = 64};
+
+// With -O, entries are read up to SORT_CHUNK at a time and removed in
+// inode order, which keeps the inode table and bitmap writes together
+// instead of scattered in hash order
+enum {SORT_CHUNK = 1 << 16};
+
+struct rm_chunk {
+	struct rm_entry *ents;
+	size_t len, pos, cap;
+	char *names;
+	size_t used, size;
+	int err; // From reading, once the chunk runs out
+	bool end;
+};
+
+struct rm_frame {
+	struct rm_frame *parent, *child;
+	struct rm_path path;
+	struct rm_stream *dp; // NULL while closed
+	dev_t dev;
+	ino_t ino;
+	struct rm_kept kept;
+	struct rm_chunk chunk;
+	bool reopened, failed;
+};
+
+static struct rm_frame *frame_open(int dirfd, struct rm_frame *parent, const struct rm_path *path) {
+	struct rm_frame *f = calloc(1, sizeof *f);
+	char *name = f ? strdup(path->name) : NULL;
+	if (!name) {
+		free(f);
+		return NULL;
+	}
+	f->parent = parent;
+	f->path = (struct rm_path){path->parent, name};
+
+	struct stat st;
+	int fd = rm_openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0 || rm_fstat(fd, &st) || !(f->dp = stream_open(fd))) {
+		int err = errno;
+		if (fd >= 0) rm_close(fd);
+		free(name);
+		free(f);
+		errno = err;
+		return NULL;
+	}
+	f->dev = st.st_dev;
+	f->ino = st.st_ino;
+	if (parent) parent->child = f;
+	return f;
+}
+
+static void frame_free(struct rm_frame *f) {
+	if (f->dp) stream_close(f->dp);
+	if (f->parent) f->parent->child = NULL;
+	free(f->kept.inos);
+	free(f->chunk.ents);
+	free(f->chunk.names);
+	free((char *)f->path.name);
+	free(f);
+}
+
+// Closes a frame until it's reopened. What's left of its chunk gets read
+// again from the start then, so there's no use keeping it meanwhile
+static void frame_close(struct rm_frame *f) {
+	stream_close(f->dp);
+	f->dp = NULL;
+	free(f->chunk.ents);
+	free(f->chunk.names);
+	f->chunk = (struct rm_chunk){0};
+}
+
+// Opens a closed frame again from its child
+static int frame_reopen(struct rm_frame *f) {
+	int fd = rm_openat(f->child->dp->fd, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) return -1;
 	struct stat st;
+	int err = rm_fstat(fd, &st) ? errno : 0;
+	// Otherwise it's been moved out from under us
+	if (!err && (st.st_dev != f->dev || st.st_ino != f->ino)) err = ENOENT;
+	if (!err && !(f->dp = stream_open(fd))) err = errno;
+	if (err) {
+		rm_close(fd);
+		errno = err;
+		return -1;
+	}
+	f->reopened = true;
+	return 0;
+}
+
+// LSD radix sort, a byte at a time, skipping bytes that are all the same
+static void sort_inodes(struct rm_entry *ents, size_t n) {
+	struct rm_entry *tmp = n > 1 ? malloc(n * sizeof *tmp) : NULL;
+	// Unsorted is still correct
+	if (!tmp) return;
+	struct rm_entry *from = ents, *to = tmp;
+	for (unsigned shift = 0; shift < sizeof (ino_t) * CHAR_BIT; shift += 8) {
+		size_t count[256] = {0};
+		for (size_t i = 0; i < n; i++) count[(uint64_t)from[i].ino >> shift & 0xff]++;
+		if (count[(uint64_t)from[0].ino >> shift & 0xff] == n) continue;
+
+		size_t sum = 0;
+		for (int b = 0; b < 256; b++) {
+			size_t c = count[b];
+			count[b] = sum;
+			sum += c;
+		}
+		for (size_t i = 0; i < n; i++) to[count[(uint64_t)from[i].ino >> shift & 0xff]++] = from[i];
+		struct rm_entry *t = from;
+		from = to;
+		to = t;
+	}
+	if (from != ents) memcpy(ents, from, n * sizeof *ents);
+	free(tmp);
+}
+
+static bool chunk_add(struct rm_chunk *c, const struct rm_entry *e) {
+	size_t len = strlen(e->name) + 1;
+	if (c->len == c->cap) {
+		size_t cap = c->cap ? c->cap * 2 : 64;
+		struct rm_entry *ents = realloc(c->ents, cap * sizeof *ents);
+		if (!ents) return false;
+		c->ents = ents;
+		c->cap = cap;
+	}
+	if (c->size - c->used < len) {
+		size_t size = c->size ? c->size * 2 : 1024;
+		while (size - c->used < len) size *= 2;
+		char *names = realloc(c->names, size);
+		if (!names) return false;
+		c->names = names;
+		c->size = size;
+	}
+	memcpy(c->names + c->used, e->name, len);
+	c->ents[c->len++] = (struct rm_entry){e->ino, e->type, c->used, NULL};
+	c->used += len;
+	return true;
+}
+
+// Reads the next chunk of f and sorts it
+static void chunk_fill(struct rm_frame *f) {
+	struct rm_chunk *c = &f->chunk;
+	c->len = c->pos = c->used = 0;
+	struct rm_entry e;
+	while (c->len < SORT_CHUNK) {
+		if (!stream_next(f->dp, &e)) {
+			c->err = errno;
+			c->end = true;
+			break;
+		}
+		if (f->reopened && kept(&f->kept, e.ino)) continue;
+		if (!chunk_add(c, &e)) {
+			c->err = errno;
+			break;
+		}
+	}
+	for (size_t i = 0; i < c->len; i++) c->ents[i].name = c->names + c->ents[i].off;
+	sort_inodes(c->ents, c->len);
+}
+
+// The next entry to remove from f. At the end, errno is nonzero if reading
+// failed
+static bool frame_next(struct rm_frame *f, struct rm_entry *e) {
+	if (opt.sort) {
+		struct rm_chunk *c = &f->chunk;
+		if (c->pos == c->len && !c->err && !c->end) chunk_fill(f);
+		if (c->pos < c->len) {
+			*e = c->ents[c->pos++];
+			return true;
+		}
+		errno = c->err;
+		c->err = 0;
+		return false;
+	}
+
+	while (stream_next(f->dp, e)) {
+		if (!f->reopened || !kept(&f->kept, e->ino)) return true;
+	}
+	return false;
+}
+
+static long max_open_dirs(void) {
+	struct rlimit rl;
+	long max = MAX_OPEN_DIRS;
+	if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur != RLIM_INFINITY && (long)rl.rlim_cur / 4 < max) {
+		max = rl.rlim_cur / 4;
+	}
+	return max < 2 ? 2 : max;
+}
+
+// Removes everything in a directory. What's in it is only reported on, not
+// counted against it; removing the directory itself will fail if anything
+// is left
+static int rm_contents(int base, const struct rm_path *path, long max_open) {
+	struct rm_frame *root = frame_open(base, NULL, path);
+	if (!root) return path_error(path), 1;
+
+	// Open frames always run from oldest down to top
+	struct rm_frame *top = root, *oldest = root;
+	long nopen = 1;
+	int ret = 0;
+	while (top) {
+		int fd = top->dp->fd;
+		struct rm_entry de;
+		if (frame_next(top, &de)) {
+#ifdef __linux__
+			if (use_uring && de.type && de.type != S_IFDIR) {
+				batch_unlink(fd, &top->path, &top->kept, de.ino, de.name);
+				continue;
+			}
+			batch_flush();
+#endif
+			struct rm_path entry = {&top->path, de.name};
+			int r = rm_check(fd, &entry, de.type);
+			if (r == RM_FAILED || r == RM_KEPT) keep(&top->kept, de.ino);
+			if (r != RM_DIR) continue;
+
+			if (nopen >= max_open) {
+				frame_close(oldest);
+				oldest = oldest->child;
+				nopen--;
+			}
+			struct rm_frame *f = frame_open(fd, top, &entry);
+			if (!f) {
+				path_error(&entry);
+				keep(&top->kept, de.ino);
+				continue;
+			}
+			top = f;
+			nopen++;
+			continue;
+		}
+
+		// That's everything in top
+		// An error looks just like the end, so we gotta check errno
+		if (errno) {
+			path_error(&top->path);
+			top->failed = true;
+		}
+#ifdef __linux__
+		batch_flush();
+#endif
+		struct rm_frame *done = top;
+		if (!(top = done->parent)) {
+			ret = done->failed;
+			frame_free(done);
+			break;
+		}
+		if (!top->dp) {
+			if (frame_reopen(top)) {
+				// Without it, there's no way back up
+				path_error(&top->path);
+				for (struct rm_frame *f = done, *next; f; f = next) {
+					next = f->parent;
+					frame_free(f);
+				}
+				return 1;
+			}
+			oldest = top;
+			nopen++;
+		}
+		if (!done->failed && rm_unlinkat(top->dp->fd, done->path.name, AT_REMOVEDIR)) {
+			path_error(&done->path);
+			done->failed = true;
+		}
+		if (done->failed) keep(&top->kept, done->ino);
+		frame_free(done);
+		nopen--;
+	}
+	return ret;
+}
+
+// }}}
+
+// Parallel removal {{{
+
+// With -j, each directory is a task. Whoever takes one removes everything in
+// it but the directories, which are queued up in turn; once the last of
+// those is gone, the directory goes too. Workers have their own deques of
+// tasks, taking the newest from their own and the oldest from others'
+
+struct rm_dir {
+	struct rm_dir *parent;
+	int base_fd; // What the operand is relative to
+	char *name;
+	struct rm_path path;
+	struct rm_stream *dp; // Open from when it's read until it's removed
+	size_t pending; // Subdirectories left, plus one until it's been read
+	bool failed;
+	int *ret; // Where an operand's result goes
+};
+
+struct rm_deque {
+	struct rm_dir **tasks;
+	size_t head, len, cap;
+	pthread_mutex_t lock;
+};
+
+// When there's no fd to spare, a worker removes the whole subtree itself with
+// rm_contents, keeping this many directories open. Each worker gets that many
+// (plus one, since reopening a parent briefly needs another) set aside
+enum {WORKER_OPEN_DIRS = 8};
+
+struct rm_pool {
+	struct rm_deque *deques;
+	long nworkers;
+	long queued, busy;
+	// Every directory being read keeps an fd open until it's removed
+	long fds;
+	bool done;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+struct rm_worker {
+	struct rm_pool *pool;
+	long id;
+};
+
+static int deque_push(struct rm_deque *q, struct rm_dir *d) {
+	pthread_mutex_lock(&q->lock);
+	if (q->len == q->cap) {
+		size_t cap = q->cap ? q->cap * 2 : 64;
+		struct rm_dir **tasks = malloc(cap * sizeof *tasks);
+		if (!tasks) return pthread_mutex_unlock(&q->lock), -1;
+		for (size_t i = 0; i < q->len; i++) tasks[i] = q->tasks[(q->head + i) % q->cap];
+		free(q->tasks);
+		q->tasks = tasks;
+		q->head = 0;
+		q->cap = cap;
+	}
+	q->tasks[(q->head + q->len++) % q->cap] = d;
+	pthread_mutex_unlock(&q->lock);
+	return 0;
+}
+
+static struct rm_dir *deque_take(struct rm_deque *q, bool steal) {
+	struct rm_dir *d = NULL;
+	pthread_mutex_lock(&q->lock);
+	if (q->len) {
+		if (steal) {
+			d = q->tasks[q->head];
+			q->head = (q->head + 1) % q->cap;
+			q->len--;
+		} else {
+			d = q->tasks[(q->head + --q->len) % q->cap];
+		}
+	}
+	pthread_mutex_unlock(&q->lock);
+	return d;
+}
+
+static void pool_push(struct rm_pool *pool, long self, struct rm_dir *d);
+
+// Removes d now that everything in it is gone, then its parent if that was
+// the last thing in that
+static void dir_finish(struct rm_pool *pool, struct rm_dir *d) {
+	while (d) {
+		struct rm_dir *parent = d->parent;
+		int fd = parent ? parent->dp->fd : d->base_fd;
+		if (d->dp) {
+			stream_close(d->dp);
+			pthread_mutex_lock(&pool->lock);
+			pool->fds++;
+			pthread_mutex_unlock(&pool->lock);
+		}
+
+		int ret = d->failed;
+		if (!ret && rm_unlinkat(fd, d->name, AT_REMOVEDIR)) {
+			path_error(&d->path);
+			ret = 1;
+		}
+		if (d->ret) *d->ret = ret;
+		free(d->name);
+		free(d);
+
+		d = NULL;
+		if (parent) {
+			pthread_mutex_lock(&pool->lock);
+			if (!--parent->pending) d = parent;
+			pthread_mutex_unlock(&pool->lock);
+		}
+	}
+}
+
+static void dir_release(struct rm_pool *pool, struct rm_dir *d) {
+	pthread_mutex_lock(&pool->lock);
+	bool last = !--d->pending;
+	pthread_mutex_unlock(&pool->lock);
+	if (last) dir_finish(pool, d);
+}
+
+static void dir_read(struct rm_pool *pool, long self, struct rm_dir *d) {
+	int base = d->parent ? d->parent->dp->fd : d->base_fd;
+	pthread_mutex_lock(&pool->lock);
+	bool have_fd = pool->fds > 0;
+	if (have_fd) pool->fds--;
+	pthread_mutex_unlock(&pool->lock);
+
+	if (!have_fd) {
+		// Keeping any more open would risk EMFILE, so do the whole
+		// subtree here and now
+		d->failed = rm_contents(base, &d->path, WORKER_OPEN_DIRS);
+		dir_release(pool, d);
+		return;
+	}
+
+	int fd = rm_openat(base, d->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0 || !(d->dp = stream_open(fd))) {
+		path_error(&d->path);
+		if (fd >= 0) rm_close(fd);
+		pthread_mutex_lock(&pool->lock);
+		pool->fds++;
+		pthread_mutex_unlock(&pool->lock);
+		d->failed = true;
+		dir_release(pool, d);
+		return;
+	}
+
+	struct rm_entry de;
+	while (stream_next(d->dp, &de)) {
+		struct rm_path path = {&d->path, de.name};
+
+		struct stat st;
+		st.st_nlink = 0; // Unknown, so nothing's known to be freed
+		mode_t type = de.type;
+		if (!type) {
+			if (rm_fstatat(fd, de.name, &st, AT_SYMLINK_NOFOLLOW)) {
+				if (!opt.force || errno != ENOENT) path_error(&path);
+				continue;
+			}
+			type = st.st_mode & S_IFMT;
+		}
+		if (type != S_IFDIR) {
+			if (!rm_unlinkat(fd, de.name, 0)) {
+				if (st.st_nlink == 1) COUNT(bytes, (unsigned long long)st.st_blocks * 512);
+				continue;
+			}
+			// Otherwise it's become a directory since it was read
+			if (errno != EISDIR) {
+				if (!opt.force || errno != ENOENT) path_error(&path);
+				continue;
+			}
+		}
+
+		struct rm_dir *child = calloc(1, sizeof *child);
+		if (!child || !(child->name = strdup(de.name))) {
+			free(child);
+			if (!rm_contents(fd, &path, WORKER_OPEN_DIRS) && rm_unlinkat(fd, de.name, AT_REMOVEDIR)) path_error(&path);
+			continue;
+		}
+		child->parent = d;
+		child->path = (struct rm_path){&d->path, child->name};
+		child->pending = 1;
+		pthread_mutex_lock(&pool->lock);
+		d->pending++;
+		pthread_mutex_unlock(&pool->lock);
+		pool_push(pool, self, child);
+	}
+	if (errno) {
+		path_error(&d->path);
+		d->failed = true;
+	}
+	dir_release(pool, d);
+}
+
+static void pool_push(struct rm_pool *pool, long self, struct rm_dir *d) {
+	// Without room to queue it, it'll have to be done now
+	if (deque_push(&pool->deques[self], d)) {
+		dir_read(pool, self, d);
+		return;
+	}
+	pthread_mutex_lock(&pool->lock);
+	pool->queued++;
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static struct rm_dir *pool_take(struct rm_pool *pool, long self) {
+	struct rm_dir *d = deque_take(&pool->deques[self], false);
+	for (long i = 1; !d && i < pool->nworkers; i++) {
+		d = deque_take(&pool->deques[(self + i) % pool->nworkers], true);
+	}
+	return d;
+}
+
+static void *rm_worker(void *arg) {
+	struct rm_worker *w = arg;
+	struct rm_pool *pool = w->pool;
+	for (;;) {
+		struct rm_dir *d = pool_take(pool, w->id);
+		if (d) {
+			pthread_mutex_lock(&pool->lock);
+			pool->queued--;
+			pool->busy++;
+			pthread_mutex_unlock(&pool->lock);
+
+			dir_read(pool, w->id, d);
+
+			pthread_mutex_lock(&pool->lock);
+			if (!--pool->busy && !pool->queued) {
+				pool->done = true;
+				pthread_cond_broadcast(&pool->cond);
+			}
+			pthread_mutex_unlock(&pool->lock);
+			continue;
+		}
+
+		// Anything queued might be taken before we get to it, but then
+		// there'll be more or we'll be done
+		pthread_mutex_lock(&pool->lock);
+		while (!pool->done && pool->queued <= 0) pthread_cond_wait(&pool->cond, &pool->lock);
+		bool done = pool->done;
+		pthread_mutex_unlock(&pool->lock);
+		if (done) break;
+	}
+	return NULL;
+}
+
+// Same as rm_contents followed by removing the directory, but spread over
+// opt.jobs threads
+static int rm_parallel(int dirfd, const struct rm_path *path) {
+	// Half the fd limit goes to the pool, the other half to everything else
+	long per_worker = WORKER_OPEN_DIRS + 1, budget = 1024 + opt.jobs * per_worker;
+	struct rlimit rl;
+	if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur != RLIM_INFINITY && (long)rl.rlim_cur / 2 < budget) {
+		budget = rl.rlim_cur / 2;
+	}
+	// Fewer workers is better than running out
+	struct rm_pool pool = {.nworkers = opt.jobs};
+	if ((budget - 1) / per_worker < pool.nworkers) pool.nworkers = (budget - 1) / per_worker;
+	if (pool.nworkers < 1) {
+		if (rm_contents(dirfd, path, max_open_dirs())) return 1;
+		if (rm_unlinkat(dirfd, path->name, AT_REMOVEDIR)) return path_error(path), 1;
+		return 0;
+	}
+	pool.fds = budget - pool.nworkers * per_worker;
+	if (pool.fds > 1024) pool.fds = 1024;
+
+	int ret = 1;
+	struct rm_dir *root = calloc(1, sizeof *root);
+	pool.deques = calloc(pool.nworkers, sizeof *pool.deques);
+	struct rm_worker *workers = malloc(pool.nworkers * sizeof *workers);
+	pthread_t *threads = malloc(pool.nworkers * sizeof *threads);
+	if (!root || !(root->name = strdup(path->name)) || !pool.deques || !workers || !threads) {
+		if (root) free(root->name);
+		free(root);
+		free(pool.deques);
+		free(workers);
+		free(threads);
+		if (rm_contents(dirfd, path, max_open_dirs())) return 1;
+		if (rm_unlinkat(dirfd, path->name, AT_REMOVEDIR)) return path_error(path), 1;
+		return 0;
+	}
+	root->base_fd = dirfd;
+	root->path = (struct rm_path){path->parent, root->name};
+	root->pending = 1;
+	root->ret = &ret;
+
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.cond, NULL);
+	for (long i = 0; i < pool.nworkers; i++) {
+		pthread_mutex_init(&pool.deques[i].lock, NULL);
+		workers[i] = (struct rm_worker){&pool, i};
+	}
+	pool_push(&pool, 0, root);
+
+	// We're worker 0, so there's always at least one
+	long nthreads = 1;
+	for (; nthreads < pool.nworkers; nthreads++) {
+		if (pthread_create(&threads[nthreads], NULL, rm_worker, &workers[nthreads])) break;
+	}
+	rm_worker(&workers[0]);
+	for (long i = 1; i < nthreads; i++) pthread_join(threads[i], NULL);
+
+	for (long i = 0; i < pool.nworkers; i++) {
+		free(pool.deques[i].tasks);
+		pthread_mutex_destroy(&pool.deques[i].lock);
+	}
+	pthread_mutex_destroy(&pool.lock);
+	pthread_cond_destroy(&pool.cond);
+	free(pool.deques);
+	free(workers);
+	free(threads);
+	return ret;
+}
+
+// }}}
+
+// Everything POSIX says to do with a file, short of emptying a directory.
+// type is what readdir said it was, if anything; the stat it saves is most
+// of the cost of removing a file
+static int rm_check(int dirfd, const struct rm_path *path, mode_t type) {
+	const char *fn = path->name;
+	bool guessed = type;
+	struct stat st;
+	st.st_nlink = 0; // Unknown, so nothing's known to be freed
 	// Step 1 in POSIX spec
-	if (stat(fn, &st)) {
-		if (opt.force && errno == ENOENT) return 0;
-		perrorf("%s/%s", cwd, fn);
-		return 1;
+	if (!type) {
+		if (rm_fstatat(dirfd, fn, &st, AT_SYMLINK_NOFOLLOW)) {
+			if (opt.force && errno == ENOENT) return RM_GONE;
+			return path_error(path), RM_FAILED;
+		}
+		type = st.st_mode & S_IFMT;
 	}
 
 	// Step 3 in POSIX spec (no clue why they made it step 3)
-	if (stdin_is_term && access(fn, W_OK)) {
-		eprintf("Remove non-writeable '%s/%s'? [y/N] ", cwd, fn);
-		if (!confirm()) return 0;
+	if (!opt.force && stdin_is_term && type != S_IFLNK && rm_faccessat(dirfd, fn, W_OK, 0)) {
+		if (!path_confirm("Remove non-writeable '%s'? [y/N] ", path)) return RM_KEPT;
 	} else if (opt.confirm) {
-		eprintf("Remove '%s/%s'? [y/N] ", cwd, fn);
-		if (!confirm()) return 0;
+		if (!path_confirm("Remove '%s'? [y/N] ", path)) return RM_KEPT;
 	}
 
 	// Step 2 in POSIX spec
-	if (S_ISDIR(st.st_mode)) {
-		if (!opt.recurse) return eprintf("%s/%s: is a directory. Try using -r\n", cwd, fn), 1;
-
-		DIR *dp = opendir(fn);
-		if (!dp) return perror(fn), 1;
-		struct dirent *de;
-		// Traverse the directory and remove each entity
-		if (chdir(fn)) perrorf("chdir: %s/%s", cwd, fn);
-		while ((errno = 0, de = readdir(dp))) {
-			if (!strcmp(de->d_name, ".")) continue;
-			if (!strcmp(de->d_name, "..")) continue;
-			do_rm(de->d_name);
-		}
-		if (chdir(cwd)) perrorf("chdir: %s", cwd);
-		closedir(dp);
-		// readdir is a little bit odd, so we gotta check errno
-		// Bear in mind that this will show closedir's error if it errored, rather than readdir's
-		if (errno) return perrorf("%s/%s", cwd, fn), 1;
-
-		// Delete the directory
-		if (rmdir(fn)) return perrorf("%s/%s", cwd, fn), 1;
-	} else {
-		// Step 4 in POSIX spec
-		if (unlink(fn)) return perrorf("%s/%s", cwd, fn), 1;
+	if (type == S_IFDIR) {
+		if (opt.recurse) return RM_DIR;
+		char *s = path_str(path);
+		eprintf("%s: is a directory. Try using -r\n", s ? s : fn);
+		COUNT(errors, 1);
+		free(s);
+		return RM_FAILED;
+	}
+
+	// Step 4 in POSIX spec
+	if (rm_unlinkat(dirfd, fn, 0)) {
+		if (opt.force && errno == ENOENT) return RM_GONE;
+		// It was a directory after all, by now anyway
+		if (errno == EISDIR && guessed) return rm_check(dirfd, path, 0);
+		return path_error(path), RM_FAILED;
 	}
+	// Other links keep the blocks in use
+	if (st.st_nlink == 1) COUNT(bytes, (unsigned long long)st.st_blocks * 512);
+	return RM_GONE;
+}
+
+// Removes a directory rm_check has OK'd
+static int rm_dir(int dirfd, const struct rm_path *path) {
+	if (opt.jobs > 1) return rm_parallel(dirfd, path);
+	if (rm_contents(dirfd, path, max_open_dirs())) return 1;
+	if (rm_unlinkat(dirfd, path->name, AT_REMOVEDIR)) return path_error(path), 1;
 	return 0;
 }
 
+static int rm_at(int dirfd, const struct rm_path *path, mode_t type) {
+	switch (rm_check(dirfd, path, type)) {
+	case RM_FAILED:
+		return 1;
+	case RM_DIR:
+		return rm_dir(dirfd, path);
+	default:
+		return 0;
+	}
+}
+
+// Staging {{{
+
+// With -A, directories are renamed into a staging directory on the same
+// filesystem and left to a detached reaper, so rm returns straight away.
+// That's .rm-staging at the root of the filesystem if we can use it,
+// otherwise next to the operand. Reapers take turns on a lock file in
+// there and clear out everything they find, so whatever a crashed run left
+// behind goes with the next one. Once it's empty, the staging directory is
+// removed too. A detached reaper has nowhere to complain to, so it writes
+// to a log in there, which the next run to stage there prints
+
+#define STAGING ".rm-staging"
+#define STAGING_LOCK ".lock"
+#define STAGING_LOG ".log"
+
+struct rm_stage {
+	int fd;
+	dev_t dev;
+	ino_t ino;
+};
+
+static struct {
+	struct rm_stage *dirs;
+	size_t len, cap;
+} stages = {0};
+
+// Locks a staging directory against other reapers. Once the last one's
+// removed the directory, the lock file may be gone by the time we have it,
+// and then it's no good
+static int stage_lock(int fd, bool wait) {
+	for (;;) {
+		int lock = openat(fd, STAGING_LOCK, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+		if (lock < 0) return -1;
+		struct flock fl = {.l_type = F_WRLCK, .l_whence = SEEK_SET};
+		struct stat st;
+		if (fcntl(lock, wait ? F_SETLKW : F_SETLK, &fl) || fstat(lock, &st)) {
+			close(lock);
+			return -1;
+		}
+		if (st.st_nlink) return lock;
+		close(lock);
+	}
+}
+
+// Prints what an earlier reaper logged, unless one's still at it
+static void stage_report(int fd) {
+	int lock = stage_lock(fd, false);
+	if (lock < 0) return;
+	int log = openat(fd, STAGING_LOG, O_RDWR | O_CLOEXEC);
+	char buf[4096];
+	ssize_t n;
+	if (log >= 0 && (n = read(log, buf, sizeof buf)) > 0) {
+		eprintf("rm: a background removal failed:\n");
+		do fwrite(buf, 1, n, stderr); while ((n = read(log, buf, sizeof buf)) > 0);
+		if (ftruncate(log, 0)) perror("ftruncate: " STAGING "/" STAGING_LOG);
+	}
+	if (log >= 0) close(log);
+	close(lock);
+}
+
+// Opens (and makes, if need be) the staging directory in dirfd
+static int stage_open(int dirfd) {
+	if (mkdirat(dirfd, STAGING, 0700) && errno != EEXIST) return -1;
+	int fd = rm_openat(dirfd, STAGING, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0) return -1;
+	struct stat st;
+	// Someone else's could be emptied by them, or read by anyone
+	if (rm_fstat(fd, &st) || st.st_uid != geteuid() || st.st_mode & 077) {
+		rm_close(fd);
+		return -1;
+	}
+
+	for (size_t i = 0; i < stages.len; i++) {
+		if (stages.dirs[i].dev == st.st_dev && stages.dirs[i].ino == st.st_ino) {
+			rm_close(fd);
+			return stages.dirs[i].fd;
+		}
+	}
+	if (stages.len == stages.cap) {
+		size_t cap = stages.cap ? stages.cap * 2 : 4;
+		struct rm_stage *dirs = realloc(stages.dirs, cap * sizeof *dirs);
+		if (!dirs) {
+			rm_close(fd);
+			return -1;
+		}
+		stages.dirs = dirs;
+		stages.cap = cap;
+	}
+	stages.dirs[stages.len++] = (struct rm_stage){fd, st.st_dev, st.st_ino};
+	stage_report(fd);
+	return fd;
+}
+
+// Finds a staging directory for a directory operand, going up through ".."
+// until the filesystem ends
+static int stage_find(int dirfd, const char *name) {
+	int dir = rm_openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	struct stat st;
+	if (dir < 0) return -1;
+	if (rm_fstat(dir, &st)) {
+		rm_close(dir);
+		return -1;
+	}
+
+	int top = dir, parent = -1;
+	for (;;) {
+		int up = rm_openat(top, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		struct stat ust;
+		if (up < 0) break;
+		// At / (or somewhere we can't see past), ".." is itself
+		if (rm_fstat(up, &ust) || ust.st_dev != st.st_dev || ust.st_ino == st.st_ino) {
+			rm_close(up);
+			break;
+		}
+		if (top != dir && top != parent) rm_close(top);
+		if (parent < 0) parent = up;
+		top = up;
+		st = ust;
+	}
+
+	// If the operand is the root, it can't be moved anywhere
+	int fd = top != dir ? stage_open(top) : -1;
+	if (fd < 0 && parent >= 0 && parent != top) fd = stage_open(parent);
+	if (top != dir && top != parent) rm_close(top);
+	if (parent >= 0) rm_close(parent);
+	rm_close(dir);
+	return fd;
+}
+
+static bool stage(int dirfd, const struct rm_path *path) {
+	static unsigned count = 0;
+	int fd = stage_find(dirfd, path->name);
+	if (fd < 0) return false;
+	char name[64];
+	snprintf(name, sizeof name, "%ld.%ld.%u", (long)getpid(), (long)time(NULL), count++);
+	return !renameat(dirfd, path->name, fd, name);
+}
+
+static int rm_async(int dirfd, const struct rm_path *path) {
+	switch (rm_check(dirfd, path, 0)) {
+	case RM_FAILED:
+		return 1;
+	case RM_DIR:
+		if (stage(dirfd, path)) return 0;
+		// Across mounts, or with nowhere to put it, it has to go now
+		return rm_dir(dirfd, path);
+	default:
+		return 0;
+	}
+}
+
+// Empties a staging directory, going round again for anything staged
+// while we were at it, and removes it if that leaves nothing. Returns
+// nonzero if anything's left
+static int stage_reap(int fd) {
+	int lock = stage_lock(fd, true);
+	struct rm_stream *dp = NULL;
+	if (lock < 0 || !(dp = stream_open(fd))) {
+		perror(STAGING);
+		if (lock >= 0) close(lock);
+		return 1;
+	}
+
+	struct rm_path path = {NULL, STAGING};
+	struct rm_kept failed = {0};
+	bool progress;
+	do {
+		progress = false;
+		stream_rewind(dp);
+		struct rm_entry de;
+		while (stream_next(dp, &de)) {
+			if (!strcmp(de.name, STAGING_LOCK) || !strcmp(de.name, STAGING_LOG)) continue;
+			// Once is enough to find out it can't go
+			if (kept(&failed, de.ino)) continue;
+			if (rm_at(dp->fd, &(struct rm_path){&path, de.name}, 0)) keep(&failed, de.ino);
+			else progress = true;
+		}
+	} while (progress);
+	bool left = failed.len;
+	free(failed.inos);
+
+	struct stat st;
+	if (!left && (fstatat(fd, STAGING_LOG, &st, 0) || !st.st_size)) {
+		// Only if it's still the staging directory we had
+		int parent = openat(fd, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		struct stat here, there;
+		if (parent >= 0 && !fstat(fd, &here) && !fstatat(parent, STAGING, &there, AT_SYMLINK_NOFOLLOW) &&
+				here.st_dev == there.st_dev && here.st_ino == there.st_ino) {
+			unlinkat(fd, STAGING_LOG, 0);
+			unlinkat(fd, STAGING_LOCK, 0);
+			// Someone may have staged something since, and that's fine
+			unlinkat(parent, STAGING, AT_REMOVEDIR);
+		}
+		if (parent >= 0) close(parent);
+	}
+	stream_close(dp);
+	close(lock); // Unlocks it
+	return left;
+}
+
+// Closes fds lo to hi, as far as there are any
+static void close_fds(unsigned lo, unsigned hi) {
+#if defined(__linux__) && defined(SYS_close_range)
+	if (!syscall(SYS_close_range, lo, hi, 0)) return;
+#endif
+	long max = sysconf(_SC_OPEN_MAX);
+	if (max < 0 || max > 65536) max = 65536;
+	for (long fd = lo; fd <= (long)hi && fd < max; fd++) close(fd);
+}
+
+// Closes everything we were given, keeping just the staging directories
+static void close_inherited(void) {
+	unsigned lo = STDERR_FILENO + 1;
+	for (;;) {
+		// The next staging fd up
+		int next = -1;
+		for (size_t i = 0; i < stages.len; i++) {
+			int fd = stages.dirs[i].fd;
+			if (fd >= (int)lo && (next < 0 || fd < next)) next = fd;
+		}
+		if (next < 0) break;
+		if ((unsigned)next > lo) close_fds(lo, next - 1);
+		lo = next + 1;
+	}
+	close_fds(lo, ~0U);
+}
+
+// The detached, low-priority process that the staged directories are left
+// to, which reports into each one's log
+static void reaper(void) {
+	// Forking again lets init adopt the reaper
+	setsid();
+	pid_t pid = fork();
+	if (pid) _exit(pid < 0);
+	int null = open("/dev/null", O_RDWR);
+	if (null >= 0) {
+		// So nobody waiting on our output waits for it too
+		dup2(null, STDIN_FILENO);
+		dup2(null, STDOUT_FILENO);
+		dup2(null, STDERR_FILENO);
+		if (null > STDERR_FILENO) close(null);
+	}
+#ifdef __linux__
+	// The ring's shared with our parent
+	if (use_uring) uring_free(&ring);
+#endif
+	// Nor on any pipe or lock we were handed
+	close_inherited();
+	// So no mount is kept busy
+	if (chdir("/")) _exit(1);
+	errno = 0;
+	if (nice(19) == -1 && errno) perror("nice");
+#ifdef __linux__
+	// IOPRIO_WHO_PROCESS, IOPRIO_CLASS_IDLE: only use the disk when it's idle
+	syscall(SYS_ioprio_set, 1, 0, 3 << 13);
+	use_uring = use_uring && uring_setup();
+#endif
+
+	opt.force = opt.recurse = true;
+	opt.stats = STATS_NONE;
+	for (size_t i = 0; i < stages.len; i++) {
+		int log = openat(stages.dirs[i].fd, STAGING_LOG, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+		if (log >= 0) {
+			dup2(log, STDERR_FILENO);
+			close(log);
+		}
+		stage_reap(stages.dirs[i].fd);
+	}
+	_exit(0);
+}
+
+// Leaves the staged directories to a reaper, or if there can't be one,
+// removes them here and now
+static int reap(void) {
+	if (!stages.len) return 0;
+	pid_t pid = fork();
+	if (!pid) reaper();
+	if (pid < 0) {
+		perror("fork");
+	} else {
+		int status;
+		if (waitpid(pid, &status, 0) == pid && WIFEXITED(status) && !WEXITSTATUS(status)) return 0;
+	}
+
+	opt.force = opt.recurse = true;
+	int ret = 0;
+	for (size_t i = 0; i < stages.len; i++) ret = stage_reap(stages.dirs[i].fd) || ret;
+	return ret;
+}
+
+// }}}
+
 int main(int argc, char *argv[]) {
+	opt.jobs = 1;
+
 	int ch;
 	while ((ch = getopt(argc, argv, optstring)) >= 0) {
 		switch (ch) {
+		case 'A':
+			opt.async = true;
+			break;
+
 		case 'f':
 			opt.force = true;
 			break;
@@ -95,11 +1421,38 @@ int main(int argc, char *argv[]) {
 			opt.confirm = true;
 			break;
 
+		case 'O':
+			opt.sort = true;
+			break;
+
 		case 'R':
 		case 'r':
 			opt.recurse = true;
 			break;
 
+		case 'u':
+			opt.uring = true;
+			break;
+
+		case 'S':
+			opt.stats = STATS_TEXT;
+			break;
+
+		case 'J':
+			opt.stats = STATS_JSON;
+			break;
+
+		case 'j': {
+			char *end;
+			opt.jobs = strtol(optarg, &end, 10);
+			if (*end || opt.jobs < 1) {
+				eprintf("jobs must be a positive number\n\n");
+				print_usage(*argv);
+				return 1;
+			}
+			break;
+		}
+
 		case '?':
 		default:
 			print_usage(*argv);
@@ -107,8 +1460,22 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
-	stdin_is_term = isatty(STDIN_FILENO); // Needed by do_rm
+	stdin_is_term = isatty(STDIN_FILENO); // Needed by rm_at
+	// Questions have to be asked one at a time
+	if (opt.confirm || (stdin_is_term && !opt.force)) opt.jobs = 1, opt.uring = false, opt.async = false;
+#ifdef __linux__
+	// Without io_uring, it's the same thing a syscall at a time
+	use_uring = opt.uring && opt.jobs == 1 && uring_setup();
+#endif
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
 	int ret = 0;
-	for (int i = optind; i < argc; i++) ret = do_rm(argv[i]) || ret;
+	for (int i = optind; i < argc; i++) {
+		struct rm_path path = {NULL, argv[i]};
+		ret = (opt.async ? rm_async(AT_FDCWD, &path) : rm_at(AT_FDCWD, &path, 0)) || ret;
+	}
+	if (opt.async) ret = reap() || ret;
+	if (opt.stats) stats_report(&start);
 	return ret;
 }
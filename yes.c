@@ -1,66 +1,263 @@
 // vim: noet
 
+#define _GNU_SOURCE
+#include "lib/utils.h"
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/uio.h>
+#endif
 
 const char *usage[] = {
-	"[message...]",
+	"[-c bytes|-n lines] [message...]",
 	NULL
 };
 
-enum {BUFFER_SIZE = 1<<15}; // 32KiB
+const char *optstring = "c:n:";
 
-int main(int argc, char *argv[]) {
-	char buf[BUFFER_SIZE], *p = buf;
-	size_t len = 0;
-
-	if (argc == 1) {
-		argv[0] = "y";
-	} else {
-		argv++;
-		argc--;
+enum {BUFFER_SIZE = 1<<17}; // 128KiB
+enum {PIPE_SIZE = 1<<20}; // Default limit for unprivileged F_SETPIPE_SZ
+
+// Fills buf with as many whole copies of msg as fit (at least one), so it can
+// be output back to back; returns the length used
+static size_t fill(char *buf, size_t size, const char *msg, size_t mlen) {
+	memcpy(buf, msg, mlen);
+	size_t len = mlen;
+	// Double what's there while we can; it's far fewer memcpys than one per copy
+	while (len <= size - len) {
+		memcpy(buf + len, buf, len);
+		len *= 2;
+	}
+	while (mlen <= size - len) {
+		memcpy(buf + len, msg, mlen);
+		len += mlen;
 	}
+	return len;
+}
 
-	for (;;) {
-		size_t blen = 0;
-		for (int i = 0; i < argc; i++) {
-			// Space-separate arguments
-			if (i) {
-				if (++blen + len > BUFFER_SIZE) goto buf_done;
-				*p++ = ' ';
-			}
+static int wait_writable(int fd) {
+	struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+	while (poll(&pfd, 1, -1) < 0) {
+		if (errno != EINTR) return -1;
+	}
+	return 0;
+}
+
+// How much to output next from *off, given that *left bytes remain (or
+// forever if left is NULL)
+static size_t next_len(size_t len, size_t off, const uintmax_t *left) {
+	size_t n = len - off;
+	return left && *left < n ? *left : n;
+}
 
-			size_t slen = strlen(argv[i]);
-			blen += slen;
-			if (blen + len > BUFFER_SIZE) goto buf_done;
+// Writes buf over and over until *left runs out; *off is where the next
+// write starts within buf
+static int write_loop(int fd, const char *buf, size_t len, size_t *off, uintmax_t *left) {
+	while (!left || *left) {
+		ssize_t n = write(fd, buf + *off, next_len(len, *off, left));
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN && !wait_writable(fd)) continue;
+			return -1;
+		}
+		*off = (*off + n) % len;
+		if (left) *left -= n;
+	}
+	return 0;
+}
 
-			memcpy(p, argv[i], slen);
-			p += slen;
+#ifdef __linux__
+// Grows the pipe as far as we're allowed to; returns its capacity, or 0 if
+// fd isn't a pipe
+static size_t pipe_capacity(int fd) {
+	int size = fcntl(fd, F_GETPIPE_SZ);
+	if (size < 0) return 0;
+	for (int want = PIPE_SIZE; want > size; want /= 2) {
+		if (fcntl(fd, F_SETPIPE_SZ, want) >= 0) {
+			size = fcntl(fd, F_GETPIPE_SZ);
+			break;
 		}
+	}
+	return size < 0 ? 0 : size;
+}
 
-		if (++blen + len > BUFFER_SIZE) goto buf_done;
-		*p++ = '\n';
-		len += blen;
+// Maps the pages of buf into the pipe instead of copying them. This is safe
+// because buf never changes once it's filled, however late the reader is.
+// Returns 1 if vmsplice doesn't work here, in which case nothing was written
+static int splice_loop(int fd, const char *buf, size_t len, size_t *off, uintmax_t *left) {
+	bool spliced = false;
+	while (!left || *left) {
+		struct iovec iov = {(void *)(buf + *off), next_len(len, *off, left)};
+		ssize_t n = vmsplice(fd, &iov, 1, 0);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN && !wait_writable(fd)) continue;
+			if (!spliced && (errno == EINVAL || errno == ENOSYS)) return 1;
+			return -1;
+		}
+		spliced = true;
+		*off = (*off + n) % len;
+		if (left) *left -= n;
 	}
-buf_done:;
-
-	size_t offset = 0;
-	for (;;) {
-		offset += write(STDOUT_FILENO, buf + offset, len - offset);
-		switch (errno) {
-		case 0:
-			offset = 0;
+	return 0;
+}
+
+// For a regular file, write buf once and then keep doubling the output by
+// copying what's already there with copy_file_range, which never touches
+// userspace and can share extents on filesystems with reflinks.
+// Returns 1 if that's not possible, leaving the rest to write_loop
+static int extend_file(int fd, const char *buf, size_t len, size_t *off, uintmax_t *left) {
+	struct stat st;
+	int flags = fcntl(fd, F_GETFL);
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) || flags < 0 || (flags & O_APPEND)) return 1;
+	off_t start = lseek(fd, 0, SEEK_CUR);
+	if (start < 0) return 1;
+	// We need to read from the output too, which it usually isn't opened for
+	char path[32];
+	snprintf(path, sizeof path, "/proc/self/fd/%d", fd);
+	int rfd = open(path, O_RDONLY);
+	if (rfd < 0) return 1;
+
+	// Anything that's a multiple of the message length can be copied forward
+	size_t first = next_len(len, 0, left);
+	if (write_loop(fd, buf, len, off, &(uintmax_t){first})) return close(rfd), -1;
+	*left -= first;
+
+	// Calls can come up short (the kernel stops at about 2GiB), so the
+	// source starts at the same point in the message as the destination
+	size_t most = (1 << 30) / len * len;
+	if (!most) most = len;
+	off_t done = first;
+	while (*left) {
+		size_t phase = done % len;
+		loff_t src = start + phase, dst = start + done;
+		uintmax_t want = done - phase;
+		if (want > most) want = most;
+		if (want > *left) want = *left;
+		ssize_t n = copy_file_range(rfd, &src, fd, &dst, want, 0);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if (errno != EINVAL && errno != ENOSYS && errno != EXDEV && errno != EOPNOTSUPP) return close(rfd), -1;
 			break;
+		}
+		if (n == 0) break;
+		done += n;
+		*left -= n;
+	}
+
+	close(rfd);
+	*off = done % len;
+	if (lseek(fd, start + done, SEEK_SET) < 0) return -1;
+	return *left ? 1 : 0;
+}
+#endif
 
-		case EAGAIN:
-			errno = 0;
+// n lines is a whole number of messages, plus a prefix of one that's up to
+// some newline (messages can contain their own)
+static int lines_to_bytes(uintmax_t lines, const char *msg, size_t mlen, uintmax_t *bytes) {
+	if (!lines) return *bytes = 0, 0;
+
+	size_t nl = 0;
+	for (size_t i = 0; i < mlen; i++) nl += msg[i] == '\n';
+
+	uintmax_t reps = (lines - 1) / nl;
+	size_t rem = (lines - 1) % nl, pos = 0;
+	for (;; pos++) {
+		if (msg[pos] == '\n' && !rem--) break;
+	}
+
+	if (reps > (UINTMAX_MAX - pos - 1) / mlen) return errno = ERANGE, -1;
+	*bytes = reps * mlen + pos + 1;
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	const char *argv0 = *argv;
+	uintmax_t count, *left = NULL;
+	bool count_lines = false;
+
+	int ch;
+	while ((ch = getopt(argc, argv, optstring)) >= 0) {
+		switch (ch) {
+		case 'c':
+		case 'n':
+			if (parse_size(optarg, &count)) {
+				perrorf("%s: invalid count '%s'", argv0, optarg);
+				return 1;
+			}
+			left = &count;
+			count_lines = ch == 'n';
 			break;
 
+		case '?':
 		default:
-			perror("write");
+			print_usage(argv0);
 			return 1;
 		}
 	}
+
+	argv += optind;
+	argc -= optind;
+	if (!argc) {
+		static char *def[] = {"y"};
+		argv = def;
+		argc = 1;
+	}
+
+	// Space-separate arguments
+	size_t mlen = 0;
+	for (int i = 0; i < argc; i++) mlen += strlen(argv[i]) + 1;
+	char *msg = malloc(mlen);
+	if (!msg) return perror("malloc"), 1;
+	for (int i = 0, pos = 0; i < argc; i++) {
+		size_t slen = strlen(argv[i]);
+		memcpy(msg + pos, argv[i], slen);
+		pos += slen;
+		msg[pos++] = i < argc - 1 ? ' ' : '\n';
+	}
+
+	if (count_lines && lines_to_bytes(count, msg, mlen, &count)) {
+		perrorf("%s: too many lines", argv0);
+		return 1;
+	}
+
+	size_t size = BUFFER_SIZE;
+#ifdef __linux__
+	// Size the buffer to the pipe, so each vmsplice can fill it in one go
+	size_t pipe_size = pipe_capacity(STDOUT_FILENO);
+	if (pipe_size) size = pipe_size;
+#endif
+	long pagesz = sysconf(_SC_PAGESIZE);
+	if (pagesz <= 0) pagesz = 4096;
+	if (size < mlen) size = (mlen + pagesz - 1) / pagesz * pagesz;
+
+	char *buf;
+	if ((errno = posix_memalign((void **)&buf, pagesz, size))) return perror("posix_memalign"), 1;
+	size_t len = fill(buf, size, msg, mlen), off = 0;
+
+	int ret = 1;
+#ifdef __linux__
+	if (pipe_size) {
+		ret = splice_loop(STDOUT_FILENO, buf, len, &off, left);
+		if (ret < 0) {
+			perror("vmsplice");
+			return 1;
+		}
+	} else if (left) {
+		ret = extend_file(STDOUT_FILENO, buf, len, &off, left);
+	}
+#endif
+
+	if (ret < 0 || (ret && write_loop(STDOUT_FILENO, buf, len, &off, left))) {
+		perror("write");
+		return 1;
+	}
+	return 0;
 }